@@ -3,12 +3,19 @@
 
 #include <assert.h>
 #include <ctype.h>
+#include <limits.h>
+#include <setjmp.h>
+#include <stdarg.h>
 #include <stdbool.h>
 #include <stddef.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
 typedef struct {
     char *string;
@@ -86,6 +93,20 @@ Mnemonic mnemonics[] = {
         abort();                                                               \
     } while (0)
 
+#define da_append(xs, x)                                                       \
+    do {                                                                       \
+        if ((xs).len + 1 > (xs).cap) {                                         \
+            if ((xs).cap != 0) {                                               \
+                (xs).cap *= 2;                                                 \
+            } else {                                                           \
+                (xs).cap = 4;                                                  \
+            }                                                                  \
+            (xs).data = realloc((xs).data, sizeof(*(xs).data) * (xs).cap);     \
+            assert((xs).data != NULL);                                         \
+        }                                                                      \
+        (xs).data[(xs).len++] = (x);                                           \
+    } while (0)
+
 typedef enum {
     B_OCT,
     B_BIN,
@@ -95,11 +116,53 @@ typedef enum {
 
 #define PLOC(x) (x).file, (x).line+1, (x).col+1
 typedef struct {
-    uint16_t line;
+    uint32_t line;
     uint8_t col;
     char *file;
 } Loc;
 
+typedef struct {
+    Loc loc;
+    char *message;
+} Diagnostic;
+
+// when set (in LSP mode), errors are collected into `diagnostics` and
+// unwind to this point instead of terminating the process
+jmp_buf *error_jmp = NULL;
+struct {
+    Diagnostic *data;
+    size_t len, cap;
+} diagnostics = { 0 };
+
+static void report_error(Loc loc, const char *fmt, ...) {
+    va_list args;
+    va_start(args, fmt);
+    if (error_jmp) {
+        va_list copy;
+        va_copy(copy, args);
+        int n = vsnprintf(NULL, 0, fmt, copy);
+        va_end(copy);
+        char *message = malloc(n + 1);
+        assert(message != NULL);
+        vsnprintf(message, n + 1, fmt, args);
+        da_append(diagnostics, ((Diagnostic){loc, message}));
+    } else {
+        fprintf(stderr, "%s:%d:%d: ", PLOC(loc));
+        vfprintf(stderr, fmt, args);
+        fputc('\n', stderr);
+    }
+    va_end(args);
+}
+
+static inline bool loc_before(Loc a, Loc b) {
+    return a.line < b.line || (a.line == b.line && a.col < b.col);
+}
+
+static void fail(void) {
+    if (error_jmp) longjmp(*error_jmp, 1);
+    exit(1);
+}
+
 static inline String string_strip(String s) {
     while (*s.string == ' ' && s.length > 0) {
         s.length--;
@@ -120,7 +183,7 @@ static inline bool valid_base(char c, Base base) {
     case B_OCT:
         return '0' <= c && c <= '7';
     case B_HEX:
-        return ('0' <= c && c <= '9') || ('A' <= c && c <= 'Z');
+        return ('0' <= c && c <= '9') || ('A' <= c && c <= 'F');
     }
     return false;
 }
@@ -149,16 +212,13 @@ static inline int s_atoi(Loc loc, String s, Base base) {
         result *= b;
         char c = s.string[len];
         if (!valid_base(c, base)) {
-            fprintf(stderr, "%s:%d:%d: unexpected characted %c for base %d\n",
-                    PLOC(loc), c, b);
+            report_error(loc, "unexpected characted %c for base %d", c, b);
+            fail();
         }
         if (c >= '0' && c <= '9')
             result += c - '0';
-        else if (c >= 'A' && c <= 'Z')
-            result += c - 'A';
-        else if (c >= 'a' && c <= 'z')
-            result += c - 'a';
-        else UNREACHABLE();
+        else
+            result += c - 'A' + 10;
     }
     return result;
 }
@@ -170,28 +230,126 @@ static inline bool string_eq(String s1, String s2) {
     return memcmp(s1.string, s2.string, s1.length) == 0;
 }
 
-#define da_append(xs, x)                                                       \
-    do {                                                                       \
-        if ((xs).len + 1 > (xs).cap) {                                         \
-            if ((xs).cap != 0) {                                               \
-                (xs).cap *= 2;                                                 \
-            } else {                                                           \
-                (xs).cap = 4;                                                  \
-            }                                                                  \
-            (xs).data = realloc((xs).data, sizeof(*(xs).data) * (xs).cap);     \
-            assert((xs).data != NULL);                                         \
-        }                                                                      \
-        (xs).data[(xs).len++] = (x);                                           \
-    } while (0)
+// Permanent symbol table: open addressing hash table of all mnemonics.
+// Memory layout is the same as of image written by `--compile-pst`
+// (in native byte order), so such images are mmap'ed and used as is.
+#define PST_VERSION 1
+#define PST_NAME_MAX 7
 
-static inline bool find_mnem(Mnemonic *out, String name) {
-    for (size_t i = 0; i < ARRLEN(mnemonics); i++) {
-        if (string_eq(mnemonics[i].name, name)) {
-            if (out) *out = mnemonics[i];
-            return true;
-        }
+typedef struct {
+    char name[PST_NAME_MAX + 1]; // zero padded, empty slot has name[0] == 0
+    uint16_t opcode;
+    uint16_t kind;
+} PstEntry;
+
+typedef struct {
+    char magic[4]; // "GPST"
+    uint32_t version;
+    uint32_t size; // number of slots, power of two
+    uint32_t count;
+    PstEntry slots[];
+} PstImage;
+
+PstImage *pst = NULL;
+// image loaded with `--pst` is mapped read-only, it's copied to the heap
+// before any insertion
+bool pst_mapped = false;
+
+static inline uint32_t string_hash(String name) {
+    // FNV-1a
+    uint32_t h = 2166136261u;
+    for (int i = 0; i < name.length; i++) {
+        h ^= (unsigned char)name.string[i];
+        h *= 16777619u;
     }
-    return false;
+    return h;
+}
+
+// names are zero padded, but may take the whole array
+static inline int pst_name_length(const PstEntry *e) {
+    int n = 0;
+    while (n < (int)sizeof(e->name) && e->name[n] != 0)
+        n++;
+    return n;
+}
+
+// returns slot where `name` is, or empty slot where it should be inserted
+static inline PstEntry *pst_slot(PstImage *table, String name) {
+    uint32_t mask = table->size - 1;
+    for (uint32_t i = string_hash(name) & mask;; i = (i + 1) & mask) {
+        PstEntry *e = &table->slots[i];
+        if (e->name[0] == 0 ||
+            (pst_name_length(e) == name.length &&
+             memcmp(e->name, name.string, name.length) == 0))
+            return e;
+    }
+}
+
+static inline size_t pst_image_size(uint32_t size) {
+    return sizeof(PstImage) + size * sizeof(PstEntry);
+}
+
+static PstImage *pst_alloc(uint32_t size) {
+    PstImage *table = calloc(1, pst_image_size(size));
+    assert(table != NULL);
+    memcpy(table->magic, "GPST", 4);
+    table->version = PST_VERSION;
+    table->size = size;
+    return table;
+}
+
+static void pst_release(void) {
+    if (pst_mapped)
+        munmap(pst, pst_image_size(pst->size));
+    else
+        free(pst);
+    pst = NULL;
+    pst_mapped = false;
+}
+
+// moves entries of current table into a new heap allocated one of `size` slots
+static void pst_rehash(uint32_t size) {
+    PstImage *old = pst;
+    PstImage *table = pst_alloc(size);
+    for (uint32_t i = 0; i < old->size; i++) {
+        PstEntry *e = &old->slots[i];
+        if (e->name[0] == 0) continue;
+        *pst_slot(table, (String){e->name, pst_name_length(e)}) = *e;
+        table->count++;
+    }
+    pst_release();
+    pst = table;
+}
+
+// `replace` is false for builtin table, which has a few duplicates
+// and the first definition wins
+static void pst_insert(String name, uint16_t opcode, InstKind kind, bool replace) {
+    assert(name.length <= PST_NAME_MAX);
+    if ((pst->count + 1) * 2 > pst->size)
+        pst_rehash(pst->size * 2);
+    else if (pst_mapped)
+        pst_rehash(pst->size);
+    PstEntry *e = pst_slot(pst, name);
+    if (e->name[0] != 0 && !replace) return;
+    if (e->name[0] == 0) pst->count++;
+    memset(e->name, 0, sizeof(e->name));
+    memcpy(e->name, name.string, name.length);
+    e->opcode = opcode;
+    e->kind = kind;
+}
+
+static void pst_init_builtin(void) {
+    pst = pst_alloc(512);
+    for (size_t i = 0; i < ARRLEN(mnemonics); i++)
+        pst_insert(mnemonics[i].name, mnemonics[i].opcode, mnemonics[i].kind, false);
+}
+
+static inline bool find_mnem(Mnemonic *out, String name) {
+    if (name.length > PST_NAME_MAX) return false;
+    PstEntry *e = pst_slot(pst, name);
+    if (e->name[0] == 0) return false;
+    if (out) *out = (Mnemonic){{e->name, name.length}, e->opcode, e->kind};
+    return true;
 }
 
 typedef enum {
@@ -205,6 +363,12 @@ typedef enum {
     LEX_COMMA,
     LEX_DOT,
     LEX_MINUS,
+    LEX_BANG,
+    LEX_AMP,
+    LEX_CARET,
+    LEX_PERCENT,
+    LEX_LANGLE,
+    LEX_RANGLE,
     LEX_SEMICOLON,
     LEX_CHARACTER,
     LEX_NEWLINE,
@@ -221,7 +385,13 @@ const char *const lex_names[] = {
     [LEX_COMMA] = "`,`",
     [LEX_DOT] = "`.`",
     [LEX_MINUS] = "`-`",
-    [LEX_SEMICOLON] = "`,`",
+    [LEX_BANG] = "`!`",
+    [LEX_AMP] = "`&`",
+    [LEX_CARET] = "`^`",
+    [LEX_PERCENT] = "`%`",
+    [LEX_LANGLE] = "`<`",
+    [LEX_RANGLE] = "`>`",
+    [LEX_SEMICOLON] = "`;`",
     [LEX_CHARACTER] = "\"<character>",
     [LEX_NEWLINE] = "<newline>",
 };
@@ -238,8 +408,18 @@ typedef struct {
 
 typedef struct {
     String name; int16_t value;
+    Loc loc;
+    bool label; // `X,` rather than `X=`
+    // previous definition of the name in `names` + 1, 0 if none
+    uint32_t prev;
 } NameEntry;
 
+// a single use of a name in an expression
+typedef struct {
+    String name;
+    Loc loc;
+} NameRef;
+
 typedef struct {
     char *code;
     size_t len;
@@ -251,6 +431,10 @@ typedef struct {
     int16_t addr;
     Lexer lexer;
     Base base;
+    // FILL block was reserved in the first pass, `lexer` is at the value
+    // and only the value is resolved
+    bool fill;
+    int16_t fill_size;
 } BackpatchEntry;
 
 // global variables
@@ -264,33 +448,163 @@ struct {
     size_t len, cap;
 } backpatch = { 0 };
 
+// uses are recorded only during the first pass, backpatching re-parses
+// statements which were already seen
+struct {
+    NameRef *data;
+    size_t len, cap;
+} refs = { 0 };
+bool backpatching = false;
+
+// IFDEF/IFNDEF tests of names which were not defined at that point, if such
+// name gets defined later outside of the conditional body, the test was
+// a forward reference
+typedef struct {
+    Token name;
+    Loc body_start, body_end;
+    // the language server finds end of a true body only when it's needed
+    bool body_end_known;
+} CondTest;
+
+struct {
+    CondTest *data;
+    size_t len, cap;
+} cond_tests = { 0 };
+// number of currently open true conditional bodies
+int cond_depth = 0;
+
 typedef struct {
     Loc loc;
     int16_t v;
     bool used;
 } RamEntry;
 RamEntry ram[4096] = {0};
+
+// hash index over `names`, a slot holds index of the latest definition + 1
+struct {
+    uint32_t *slots;
+    size_t size;
+} names_index = { 0 };
+
+// While the language server assembles a chunk of a document (see
+// "incremental assembly" below), `names` holds only definitions made in
+// that chunk, words and tokens are collected instead of put into `ram`.
+typedef struct Chunk Chunk;
+Chunk *current_chunk = NULL;
+// whether the chunk depends on the current address other than by placing
+// words and labels after it, and whether it sets the address itself
+bool addr_used = false, addr_set = false;
+
+// `count` words starting at `addr`, `update` sets the value of a block
+// which is already reserved
+typedef struct {
+    int16_t addr, count, v;
+    bool update;
+    Loc loc;
+} Word;
+
+struct {
+    Word *data;
+    size_t len, cap;
+} words = { 0 };
+
+struct {
+    Token *data;
+    size_t len, cap;
+} tokens = { 0 };
+// end of the last collected token, peeking lexes the same tokens again
+char *tokens_end = NULL;
 // ----
 
 static void put_entry_in_ram(int16_t addr, Loc loc, int16_t v) {
+    // wraps around
+    addr_used |= addr >= 07777;
+    addr &= 07777;
+    if (current_chunk) {
+        da_append(words, ((Word){addr, 1, v, false, loc}));
+        return;
+    }
     if (ram[addr].used) {
-        fprintf(stderr, "%s:%d:%d: Address %o was already used at %s:%d:%d (previous value %o, new %o)\n",
-                PLOC(loc), addr, PLOC(ram[addr].loc), ram[addr].v, v);
-        exit(1);
+        report_error(loc, "Address %o was already used at %s:%d:%d (previous value %o, new %o)",
+                     addr, PLOC(ram[addr].loc), ram[addr].v, v);
+        fail();
     }
     ram[addr] = (RamEntry){loc, v, true};
 }
 
-static inline bool find_name(int16_t *out, String name) {
-    if (names.len < 1) return false;
-    size_t i = names.len;
-    while (i-->0) {
-        if (string_eq(names.data[i].name, name)) {
-            *out = names.data[i].value;
-            return true;
+// Fills `count` words starting at `addr` with `v`, whole range is checked
+// for overlap once instead of word by word
+static void put_range_in_ram(int16_t addr, int count, Loc loc, int16_t v) {
+    addr_used = true;
+    if (addr + count > (int)ARRLEN(ram)) {
+        report_error(loc, "Block of %o words at %o runs past the end of memory", count, addr);
+        fail();
+    }
+    if (current_chunk) {
+        if (count > 0) da_append(words, ((Word){addr, count, v, false, loc}));
+        return;
+    }
+    RamEntry *start = &ram[addr], *end = &ram[addr + count];
+    for (RamEntry *e = start; e < end; e++) {
+        if (e->used) {
+            report_error(loc, "Address %o was already used at %s:%d:%d (previous value %o, new %o)",
+                         (int)(e - ram), PLOC(e->loc), e->v, v);
+            fail();
         }
     }
-    return false;
+    for (RamEntry *e = start; e < end; e++)
+        *e = (RamEntry){loc, v, true};
+}
+
+// sets value of a block reserved with put_range_in_ram()
+static void update_range_in_ram(int16_t addr, int count, int16_t v) {
+    if (current_chunk) {
+        if (count > 0) da_append(words, ((Word){addr, count, v, true, {0}}));
+        return;
+    }
+    for (int i = 0; i < count; i++)
+        ram[addr + i].v = v;
+}
+
+// returns slot where `name` is, or empty slot where it should be inserted
+static inline uint32_t *names_slot(String name) {
+    size_t mask = names_index.size - 1;
+    for (size_t i = string_hash(name) & mask;; i = (i + 1) & mask) {
+        uint32_t *slot = &names_index.slots[i];
+        if (*slot == 0 || string_eq(names.data[*slot - 1].name, name))
+            return slot;
+    }
+}
+
+static void add_name(NameEntry entry) {
+    // chunk has a few names, they're searched linearly
+    if (current_chunk) {
+        da_append(names, entry);
+        return;
+    }
+    entry.prev = names_index.size ? *names_slot(entry.name) : 0;
+    da_append(names, entry);
+    if (names.len * 2 > names_index.size) {
+        free(names_index.slots);
+        names_index.size = names_index.size ? names_index.size * 2 : 256;
+        names_index.slots = calloc(names_index.size, sizeof(*names_index.slots));
+        assert(names_index.slots != NULL);
+        for (size_t i = 0; i < names.len; i++)
+            *names_slot(names.data[i].name) = i + 1;
+    } else {
+        *names_slot(entry.name) = names.len;
+    }
+}
+
+static bool chunk_find_name(int16_t *out, String name);
+
+static inline bool find_name(int16_t *out, String name) {
+    if (current_chunk) return chunk_find_name(out, name);
+    if (names_index.size == 0) return false;
+    uint32_t i = *names_slot(name);
+    if (i == 0) return false;
+    *out = names.data[i - 1].value;
+    return true;
 }
 
 bool eat_char(Lexer *lex) {
@@ -310,8 +624,24 @@ bool eat_char(Lexer *lex) {
 bool is_kind_binop(TokenKind k) {
     switch (k) {
     case LEX_PLUS:
-        return true;
     case LEX_MINUS:
+    case LEX_BANG:
+    case LEX_AMP:
+    case LEX_CARET:
+    case LEX_PERCENT:
+        return true;
+    default:
+        return false;
+    }
+}
+
+// operands separated only by whitespace are ORed together
+bool is_kind_operand(TokenKind k) {
+    switch (k) {
+    case LEX_NAME:
+    case LEX_INT:
+    case LEX_DOT:
+    case LEX_CHARACTER:
         return true;
     default:
         return false;
@@ -325,25 +655,29 @@ Token _expect_any(Token t, size_t count, TokenKind *ks) {
             return t;
         }
     }
-    fprintf(stderr, "%s:%d:%d Expected any of: ", PLOC(t.loc));
+    char expected[256] = {0};
     for (size_t i = 0; i < count; i++) {
-        fprintf(stderr, "%s, ", lex_names[ks[i]]);
+        size_t n = strlen(expected);
+        snprintf(expected + n, sizeof(expected) - n, "%s, ", lex_names[ks[i]]);
     }
-    fprintf(stderr, "but got %s\n", lex_names[t.kind]);
-    exit(1);
+    report_error(t.loc, "Expected any of: %sbut got %s", expected, lex_names[t.kind]);
+    fail();
     return (Token){0};
 }
 
 Token expect(Token t, TokenKind k) {
     if (t.kind != k) {
-        fprintf(stderr, "%s:%d:%d Expected %s but got %s (%.*s)\n", PLOC(t.loc),
-                lex_names[k], lex_names[t.kind], PS(t.str));
-        exit(1);
+        if (t.kind == LEX_NEWLINE || t.kind == LEX_END)
+            report_error(t.loc, "Expected %s but got %s", lex_names[k], lex_names[t.kind]);
+        else
+            report_error(t.loc, "Expected %s but got %s (%.*s)",
+                         lex_names[k], lex_names[t.kind], PS(t.str));
+        fail();
     }
     return t;
 }
 
-Token next_token(Lexer *lex) {
+Token lex_token(Lexer *lex) {
     while ((*lex->code == ' ' || *lex->code == '\t' || *lex->code == '\r') && lex->len > 0) {
         eat_char(lex);
     }
@@ -353,9 +687,9 @@ Token next_token(Lexer *lex) {
     }
     switch (*lex->code) {
     case '/':
-        while (*lex->code != '\n')
+        while (lex->len > 0 && *lex->code != '\n')
             eat_char(lex);
-        return next_token(lex);
+        return lex_token(lex);
     case '*':
         eat_char(lex);
         return (Token){.kind = LEX_STAR,
@@ -386,6 +720,36 @@ Token next_token(Lexer *lex) {
         return (Token){.kind = LEX_PLUS,
                        .str = (String){lex->code-1, 1},
                        .loc = lex->loc};
+    case '!':
+        eat_char(lex);
+        return (Token){.kind = LEX_BANG,
+                       .str = (String){lex->code-1, 1},
+                       .loc = lex->loc};
+    case '&':
+        eat_char(lex);
+        return (Token){.kind = LEX_AMP,
+                       .str = (String){lex->code-1, 1},
+                       .loc = lex->loc};
+    case '^':
+        eat_char(lex);
+        return (Token){.kind = LEX_CARET,
+                       .str = (String){lex->code-1, 1},
+                       .loc = lex->loc};
+    case '%':
+        eat_char(lex);
+        return (Token){.kind = LEX_PERCENT,
+                       .str = (String){lex->code-1, 1},
+                       .loc = lex->loc};
+    case '<':
+        eat_char(lex);
+        return (Token){.kind = LEX_LANGLE,
+                       .str = (String){lex->code-1, 1},
+                       .loc = lex->loc};
+    case '>':
+        eat_char(lex);
+        return (Token){.kind = LEX_RANGLE,
+                       .str = (String){lex->code-1, 1},
+                       .loc = lex->loc};
     case ';':
         eat_char(lex);
         return (Token){.kind = LEX_SEMICOLON,
@@ -396,11 +760,15 @@ Token next_token(Lexer *lex) {
         return (Token){.kind = LEX_CHARACTER,
                        .str = (String){lex->code-1, 1},
                        .loc = lex->loc};
-    case '\n':
+    case '\n': {
+        // location is on the line which the newline ends
+        Loc loc = lex->loc;
+        loc.col++;
         eat_char(lex);
         return (Token){.kind = LEX_NEWLINE,
-                       .str = (String){lex->code, 1},
-                       .loc = lex->loc};
+                       .str = (String){lex->code-1, 1},
+                       .loc = loc};
+    }
     case '$':
         return (Token){.kind = LEX_END,
                        .str = (String){lex->code, 1},
@@ -438,11 +806,22 @@ Token next_token(Lexer *lex) {
         }
     }
 fail:
-    fprintf(stderr, "%s:%d:%d Unexpected value '%c' (%d)\n", PLOC(lex->loc), *lex->code, *lex->code);
-    exit(1);
+    report_error(lex->loc, "Unexpected value '%c' (%d)", *lex->code, *lex->code);
+    fail();
     return (Token) { 0 };
 }
 
+Token next_token(Lexer *lex) {
+    Token t = lex_token(lex);
+    // tokens of a chunk are collected once, in the first pass
+    if (current_chunk && !backpatching && t.kind != LEX_NEWLINE && t.kind != LEX_END &&
+        t.str.string + t.str.length > tokens_end) {
+        da_append(tokens, t);
+        tokens_end = t.str.string + t.str.length;
+    }
+    return t;
+}
+
 Token peek_token(Lexer *lex) {
     Lexer copy = *lex;
     return next_token(&copy);
@@ -456,52 +835,96 @@ Token peek_token_n(Lexer *lex, size_t n) {
     return next_token(&copy);
 }
 
-int16_t parse_var_or_int(Lexer *lex, Base base, int16_t addr) {
-    Token t = expect_any(next_token(lex), LEX_NAME, LEX_INT, LEX_DOT);
+// All values are 12-bit words, functions return false if value depends on
+// a name which is not defined yet, `bp_cause` is set to that name then.
+bool parse_var_or_int(Lexer *lex, Base base, int16_t addr, int16_t *out, Token *bp_cause) {
+    Token t = expect_any(next_token(lex), LEX_NAME, LEX_INT, LEX_DOT, LEX_CHARACTER, LEX_MINUS);
     switch (t.kind) {
-    case LEX_NAME: {
-        int16_t v;
-        if (find_name(&v, t.str)) {
-            return v;
-        } else {
-            return -1;
-        }
-    } break;
+    case LEX_NAME:
+        if (!backpatching)
+            da_append(refs, ((NameRef){t.str, t.loc}));
+        if (find_name(out, t.str))
+            return true;
+        *bp_cause = t;
+        return false;
     case LEX_INT:
-        return s_atoi(t.loc, t.str, base);
+        *out = s_atoi(t.loc, t.str, base) & 07777;
+        return true;
     case LEX_DOT:
-        return addr;
+        addr_used = true;
+        *out = addr;
+        return true;
+    case LEX_CHARACTER:
+        *out = t.str.string[0];
+        return true;
+    case LEX_MINUS: {
+        int16_t v;
+        if (!parse_var_or_int(lex, base, addr, &v, bp_cause))
+            return false;
+        *out = -v & 07777;
+        return true;
+    }
     default:
         UNREACHABLE();
         break;
     }
     UNREACHABLE();
-    return -1;
-}
-
-int16_t parse_expr(Lexer *lex, Base base, int16_t addr, Token *bp_cause) {
-    Token potential_bp_cause = peek_token(lex);
-    int16_t v = parse_var_or_int(lex, base, addr);
-    if (v < 0)
-        *bp_cause = potential_bp_cause;
-    while (is_kind_binop(peek_token(lex).kind)) {
-        TokenKind op = next_token(lex).kind;
-        int16_t dv = parse_var_or_int(lex, base, addr);
-        switch (op) {
+    return false;
+}
+
+// PAL evaluates operators strictly left to right, there is no precedence
+bool parse_expr(Lexer *lex, Base base, int16_t addr, Token *bp_cause, int16_t *out) {
+    int16_t v, dv;
+    Token ignored;
+    bool resolved = parse_var_or_int(lex, base, addr, &v, bp_cause);
+    for (;;) {
+        Token op = peek_token(lex);
+        if (is_kind_binop(op.kind))
+            next_token(lex);
+        else if (is_kind_operand(op.kind))
+            op.kind = LEX_BANG;
+        else
+            break;
+        if (!parse_var_or_int(lex, base, addr, &dv, resolved ? bp_cause : &ignored)) {
+            resolved = false;
+            continue;
+        }
+        if (!resolved)
+            continue;
+        int r = v;
+        switch (op.kind) {
         case LEX_PLUS:
-            if (v >= 0) v += dv;
+            r += dv;
             break;
         case LEX_MINUS:
-            if (v >= 0) v -= dv;
+            r -= dv;
+            break;
+        case LEX_BANG:
+            r |= dv;
+            break;
+        case LEX_AMP:
+            r &= dv;
+            break;
+        case LEX_CARET:
+            r *= dv;
+            break;
+        case LEX_PERCENT:
+            if (dv == 0) {
+                report_error(op.loc, "Division by zero");
+                fail();
+            }
+            r /= dv;
             break;
         default:
-            TODO();
+            UNREACHABLE();
         }
+        v = r & 07777;
     }
-    return v;
+    *out = v;
+    return resolved;
 }
 
-int16_t assemble_mnemonic(Lexer *lex, Base base, int16_t addr, Token *bp_cause) {
+bool assemble_mnemonic(Lexer *lex, Base base, int16_t addr, Token *bp_cause, int16_t *out) {
     Mnemonic mnem;
     Token t = expect(next_token(lex), LEX_INST);
     find_mnem(&mnem, t.str);
@@ -513,87 +936,375 @@ int16_t assemble_mnemonic(Lexer *lex, Base base, int16_t addr, Token *bp_cause)
             I = 1<<8;
         }
         char *expr_start = lex->code;
-        int16_t v = parse_expr(lex, base, addr, bp_cause);
+        int16_t v;
+        if (!parse_expr(lex, base, addr, bp_cause, &v))
+            return false;
         if (v >= 0200) {
             Z = 1<<7;
         }
-        if (v >= 0) {
-            if (v/128 != addr/128 && Z != 0 && I == 0) {
-                String name = string_strip((String){expr_start, (int)(lex->code - expr_start)});
-                fprintf(stderr,
-                        "%s:%d:%d: `%.*s` (%o) is not on the same page as "
-                        "current address (%o)\n",
-                        PLOC(t.loc), PS(name),
-                        v, addr);
-                exit(1);
-            }
-            return mnem.opcode | I | Z | (v & 0x7F);
-        } else {
-            return -1;
+        addr_used |= Z != 0 && I == 0;
+        if (v/128 != addr/128 && Z != 0 && I == 0) {
+            String name = string_strip((String){expr_start, (int)(lex->code - expr_start)});
+            report_error(t.loc,
+                         "`%.*s` (%o) is not on the same page as "
+                         "current address (%o)",
+                         PS(name), v, addr);
+            fail();
         }
+        *out = mnem.opcode | I | Z | (v & 0x7F);
+        return true;
     } break;
     case T_DEFAULT:
-        return mnem.opcode;
+        *out = mnem.opcode;
+        return true;
     }
-    return -1;
+    UNREACHABLE();
+    return false;
 }
 
-void assemble_once(Lexer *lex, Base *base, int16_t *addr) {
-    switch (peek_token(lex).kind) {
-    case LEX_STAR: {
-        BackpatchEntry potential_bp = (BackpatchEntry){
-            .addr = *addr,
-            .base = *base,
-            .lexer = *lex,
-        };
-        next_token(lex);
-        int16_t next_addr = parse_expr(lex, *base, *addr, &potential_bp.cause);
-        if (next_addr < 0) TODO();
-        if (next_addr >= ARRLEN(ram)) TODO();
-        *addr = next_addr;
-    } break;
-    case LEX_INST: {
-        BackpatchEntry potential_bp = (BackpatchEntry){
-            .cause = peek_token(lex),
-            .addr = *addr,
-            .base = *base,
-            .lexer = *lex,
-        };
-        if (peek_token_n(lex, 2).kind == LEX_EQ) {
-            Token t = next_token(lex);
-            next_token(lex);
-            Mnemonic mnem;
-            if (!find_mnem(&mnem, t.str)) UNREACHABLE();
-            int16_t n = parse_expr(lex, *base, *addr, &potential_bp.cause);
-            if (n < 0) {
-                da_append(backpatch, potential_bp);
-                break;
+// mnemonics separated by whitespace are ORed together, e.g. `CLA CLL`
+bool assemble_mnemonics(Lexer *lex, Base base, int16_t addr, Token *bp_cause, int16_t *out) {
+    bool resolved = true;
+    int16_t r = 0, o;
+    Token ignored;
+    do {
+        if (assemble_mnemonic(lex, base, addr, resolved ? bp_cause : &ignored, &o))
+            r |= o;
+        else
+            resolved = false;
+    } while (peek_token(lex).kind == LEX_INST);
+    *out = r;
+    return resolved;
+}
+
+typedef enum {
+    SCAN_OK,
+    SCAN_NO_DELIMITER,
+    SCAN_UNTERMINATED,
+} ScanResult;
+
+// Scans a string delimited by its first non-blank character on the line,
+// with `escapes` a backslash makes the next character part of the string.
+ScanResult scan_delimited(Lexer *lex, bool escapes, String *out, char *delim_out) {
+    while (lex->len > 0 && (*lex->code == ' ' || *lex->code == '\t'))
+        eat_char(lex);
+    if (lex->len == 0 || *lex->code == '\n')
+        return SCAN_NO_DELIMITER;
+    char delim = *lex->code;
+    *delim_out = delim;
+    eat_char(lex);
+    String str = {lex->code, 0};
+    while (lex->len > 0 && *lex->code != delim && *lex->code != '\n') {
+        if (escapes && *lex->code == '\\' && lex->len > 1 && lex->code[1] != '\n') {
+            eat_char(lex);
+            str.length++;
+        }
+        eat_char(lex);
+        str.length++;
+    }
+    if (lex->len == 0 || *lex->code != delim)
+        return SCAN_UNTERMINATED;
+    eat_char(lex);
+    *out = str;
+    return SCAN_OK;
+}
+
+// Skips body of a conditional up to the matching `>` without tokenizing it,
+// angle brackets in comments, character literals and TEXT/ASCIZ strings are
+// not counted. Returns false if input ends first, `depth` is kept so that
+// skipping can continue in the next piece of input.
+bool skip_conditional_body(Lexer *lex, int *depth) {
+    while (lex->len > 0) {
+        if (isalnum(*lex->code)) {
+            String word = {lex->code, 0};
+            while (lex->len > 0 && isalnum(*lex->code)) {
+                eat_char(lex);
+                word.length++;
             }
-            if (n != mnem.opcode) {
-                fprintf(stderr,
-                        "%s:%d:%d Redefining mnemonics is not supported! "
-                        "(%.*s)\n",
-                        PLOC(t.loc), PS(t.str));
-                exit(1);
+            String str;
+            char delim;
+            if (string_eq(word, S("TEXT")))
+                scan_delimited(lex, false, &str, &delim);
+            else if (string_eq(word, S("ASCIZ")))
+                scan_delimited(lex, true, &str, &delim);
+            continue;
+        }
+        switch (*lex->code) {
+        case '/':
+            while (lex->len > 0 && *lex->code != '\n')
+                eat_char(lex);
+            continue;
+        case '"':
+            eat_char(lex);
+            break;
+        case '<':
+            (*depth)++;
+            break;
+        case '>':
+            if (--*depth == 0) {
+                eat_char(lex);
+                return true;
             }
             break;
         }
-        int16_t r = 0;
-        while (peek_token(lex).kind != LEX_NEWLINE && peek_token(lex).kind != LEX_END) {
-            Token t = expect(peek_token(lex), LEX_INST);
-            int16_t o = assemble_mnemonic(lex, *base, *addr, &potential_bp.cause);
-            if (o >= 0 && r >= 0) r |= o;
-            else r = -1;
+        eat_char(lex);
+    }
+    return false;
+}
+
+void skip_conditional(Lexer *lex, Token directive) {
+    int depth = 1;
+    if (skip_conditional_body(lex, &depth)) return;
+    report_error(directive.loc, "Unterminated %.*s, expected `>`", PS(directive.str));
+    fail();
+}
+
+// IFDEF SYM <...>, IFNDEF SYM <...>, IFZERO expr <...>, IFNZRO expr <...>
+void assemble_conditional(Lexer *lex, Base base, int16_t addr) {
+    Token directive = next_token(lex);
+    bool cond, tested = false;
+    Token name = {0};
+    if (string_eq(directive.str, S("IFDEF")) || string_eq(directive.str, S("IFNDEF"))) {
+        name = expect_any(next_token(lex), LEX_NAME, LEX_INST);
+        int16_t v;
+        bool defined = name.kind == LEX_INST || find_name(&v, name.str);
+        if (name.kind == LEX_NAME)
+            da_append(refs, ((NameRef){name.str, name.loc}));
+        cond = string_eq(directive.str, S("IFDEF")) ? defined : !defined;
+        expect(next_token(lex), LEX_LANGLE);
+        tested = !defined;
+    } else {
+        Token cause;
+        int16_t v;
+        if (!parse_expr(lex, base, addr, &cause, &v)) {
+            report_error(cause.loc,
+                         "%.*s condition depends on `%.*s`, which is not defined yet "
+                         "(forward references are not allowed in conditions)",
+                         PS(directive.str), PS(cause.str));
+            fail();
         }
-        if (r >= 0) {
-            put_entry_in_ram((*addr)++, potential_bp.cause.loc, r);
-        } else {
-            da_append(backpatch, potential_bp);
-            (*addr)++;
+        cond = string_eq(directive.str, S("IFZERO")) ? v == 0 : v != 0;
+        expect(next_token(lex), LEX_LANGLE);
+    }
+    CondTest test = {name, lex->loc, lex->loc, !cond};
+    if (cond) {
+        // a chunk usually ends before the body does
+        if (tested && !current_chunk) {
+            Lexer body = *lex;
+            skip_conditional(&body, directive);
+            test.body_end = body.loc;
+            test.body_end_known = true;
         }
-    } break;
-    case LEX_NAME: {
-        if (string_eq(peek_token(lex).str, S("DECIMAL"))) {
+        cond_depth++;
+    } else {
+        skip_conditional(lex, directive);
+        test.body_end = lex->loc;
+    }
+    if (tested)
+        da_append(cond_tests, test);
+}
+
+// Reads a string delimited by its first non-blank character directly from
+// the source, e.g. `TEXT /HELLO/`. Returns slice between the delimiters.
+String read_delimited(Lexer *lex, Token directive, bool escapes, char *delim_out) {
+    String str;
+    char delim;
+    switch (scan_delimited(lex, escapes, &str, &delim)) {
+    case SCAN_NO_DELIMITER:
+        report_error(lex->loc, "%.*s expects a delimited string", PS(directive.str));
+        fail();
+        break;
+    case SCAN_UNTERMINATED:
+        report_error(directive.loc, "Unterminated string, expected `%c`", delim);
+        fail();
+        break;
+    case SCAN_OK:
+        break;
+    }
+    if (delim_out) *delim_out = delim;
+    return str;
+}
+
+// TEXT /.../ packs two SIXBIT characters per word, terminated with
+// a zero character
+void assemble_text(Lexer *lex, int16_t *addr) {
+    Token directive = next_token(lex);
+    String str = read_delimited(lex, directive, false, NULL);
+    int16_t word = 0;
+    for (int i = 0; i < str.length; i++) {
+        int16_t c = toupper(str.string[i]) & 077;
+        if (i % 2 == 0) {
+            word = c << 6;
+        } else {
+            put_entry_in_ram(*addr, directive.loc, word | c);
+            *addr = (*addr + 1) & 07777;
+        }
+    }
+    // for odd length the terminator is the right half of the last word
+    put_entry_in_ram(*addr, directive.loc, str.length % 2 ? word : 0);
+    *addr = (*addr + 1) & 07777;
+}
+
+// ASCIZ /.../ stores one 8-bit character per word followed by a zero word,
+// supports \n, \r, \t, \0, \\ and escaped delimiter
+void assemble_asciz(Lexer *lex, int16_t *addr) {
+    Token directive = next_token(lex);
+    char delim;
+    String str = read_delimited(lex, directive, true, &delim);
+    for (int i = 0; i < str.length; i++) {
+        int16_t c = (unsigned char)str.string[i];
+        if (c == '\\') {
+            switch (c = str.string[++i]) {
+            case 'n': c = '\n'; break;
+            case 'r': c = '\r'; break;
+            case 't': c = '\t'; break;
+            case '0': c = 0; break;
+            case '\\': break;
+            default:
+                if (c == delim) break;
+                report_error(directive.loc, "Unknown escape sequence `\\%c`", c);
+                fail();
+            }
+        }
+        put_entry_in_ram(*addr, directive.loc, c & 0377);
+        *addr = (*addr + 1) & 07777;
+    }
+    put_entry_in_ram(*addr, directive.loc, 0);
+    *addr = (*addr + 1) & 07777;
+}
+
+// size of a block must be known in the first pass, since it moves
+// every following address
+int16_t parse_block_size(Lexer *lex, Base base, int16_t addr, Token directive) {
+    Token cause;
+    int16_t n;
+    if (!parse_expr(lex, base, addr, &cause, &n)) {
+        report_error(cause.loc, "%.*s size depends on `%.*s`, which is not defined yet",
+                     PS(directive.str), PS(cause.str));
+        fail();
+    }
+    return n;
+}
+
+// ZBLOCK n reserves n zero words
+void assemble_zblock(Lexer *lex, Base base, int16_t *addr) {
+    Token directive = next_token(lex);
+    int16_t n = parse_block_size(lex, base, *addr, directive);
+    put_range_in_ram(*addr, n, directive.loc, 0);
+    *addr = (*addr + n) & 07777;
+}
+
+// FILL n, expr emits n copies of expr, the block is reserved right away
+// even if expr is not resolved yet
+void assemble_fill(Lexer *lex, Base base, int16_t *addr) {
+    Token directive = next_token(lex);
+    int16_t n = parse_block_size(lex, base, *addr, directive);
+    expect(next_token(lex), LEX_COMMA);
+    BackpatchEntry potential_bp = (BackpatchEntry){
+        .addr = *addr,
+        .base = base,
+        .lexer = *lex,
+        .fill = true,
+        .fill_size = n,
+    };
+    int16_t v;
+    bool resolved = parse_expr(lex, base, *addr, &potential_bp.cause, &v);
+    put_range_in_ram(*addr, n, directive.loc, resolved ? v : 0);
+    if (!resolved)
+        da_append(backpatch, potential_bp);
+    *addr = (*addr + n) & 07777;
+}
+
+void backpatch_fill(BackpatchEntry bp) {
+    int16_t v;
+    if (!parse_expr(&bp.lexer, bp.base, bp.addr, &bp.cause, &v)) {
+        da_append(backpatch, bp);
+        return;
+    }
+    update_range_in_ram(bp.addr, bp.fill_size, v);
+}
+
+// DUBL n... stores decimal 24-bit numbers in two words each, high word first
+void assemble_dubl(Lexer *lex, int16_t *addr) {
+    Token directive = next_token(lex);
+    do {
+        bool negative = false;
+        if (peek_token(lex).kind == LEX_MINUS) {
+            next_token(lex);
+            negative = true;
+        }
+        Token t = expect(next_token(lex), LEX_INT);
+        int32_t v = s_atoi(t.loc, t.str, B_DEC);
+        if (v >= 1 << 24) {
+            report_error(t.loc, "%.*s doesn't fit in 24 bits", PS(t.str));
+            fail();
+        }
+        if (negative) v = -v;
+        put_entry_in_ram(*addr, directive.loc, (v >> 12) & 07777);
+        *addr = (*addr + 1) & 07777;
+        put_entry_in_ram(*addr, directive.loc, v & 07777);
+        *addr = (*addr + 1) & 07777;
+    } while (peek_token(lex).kind == LEX_INT || peek_token(lex).kind == LEX_MINUS);
+}
+
+void assemble_once(Lexer *lex, Base *base, int16_t *addr) {
+    switch (peek_token(lex).kind) {
+    case LEX_STAR: {
+        BackpatchEntry potential_bp = (BackpatchEntry){
+            .addr = *addr,
+            .base = *base,
+            .lexer = *lex,
+        };
+        next_token(lex);
+        int16_t next_addr;
+        if (!parse_expr(lex, *base, *addr, &potential_bp.cause, &next_addr)) {
+            report_error(potential_bp.cause.loc, "Origin depends on undefined name `%.*s`",
+                         PS(potential_bp.cause.str));
+            fail();
+        }
+        addr_set = true;
+        *addr = next_addr;
+    } break;
+    case LEX_INST: {
+        BackpatchEntry potential_bp = (BackpatchEntry){
+            .cause = peek_token(lex),
+            .addr = *addr,
+            .base = *base,
+            .lexer = *lex,
+        };
+        if (peek_token_n(lex, 2).kind == LEX_EQ) {
+            Token t = next_token(lex);
+            next_token(lex);
+            Mnemonic mnem;
+            if (!find_mnem(&mnem, t.str)) UNREACHABLE();
+            int16_t n;
+            if (!parse_expr(lex, *base, *addr, &potential_bp.cause, &n)) {
+                da_append(backpatch, potential_bp);
+                break;
+            }
+            if (n != mnem.opcode) {
+                report_error(t.loc,
+                             "Redefining mnemonics is not supported! (%.*s)",
+                             PS(t.str));
+                fail();
+            }
+            break;
+        }
+        int16_t r;
+        bool resolved = assemble_mnemonics(lex, *base, *addr, &potential_bp.cause, &r);
+        Token end = peek_token(lex);
+        if (end.kind != LEX_NEWLINE && end.kind != LEX_END &&
+            end.kind != LEX_RANGLE && end.kind != LEX_SEMICOLON)
+            expect(end, LEX_INST);
+        if (resolved) {
+            put_entry_in_ram((*addr)++, potential_bp.cause.loc, r);
+        } else {
+            da_append(backpatch, potential_bp);
+            (*addr)++;
+        }
+    } break;
+    case LEX_NAME: {
+        if (string_eq(peek_token(lex).str, S("DECIMAL"))) {
             next_token(lex);
             *base = B_DEC;
             break;
@@ -608,16 +1319,45 @@ void assemble_once(Lexer *lex, Base *base, int16_t *addr) {
             *base = B_HEX;
             break;
         }
+        if (string_eq(peek_token(lex).str, S("IFDEF")) ||
+            string_eq(peek_token(lex).str, S("IFNDEF")) ||
+            string_eq(peek_token(lex).str, S("IFZERO")) ||
+            string_eq(peek_token(lex).str, S("IFNZRO"))) {
+            assemble_conditional(lex, *base, *addr);
+            break;
+        }
+        if (string_eq(peek_token(lex).str, S("TEXT"))) {
+            assemble_text(lex, addr);
+            break;
+        }
+        if (string_eq(peek_token(lex).str, S("ASCIZ"))) {
+            assemble_asciz(lex, addr);
+            break;
+        }
+        if (string_eq(peek_token(lex).str, S("ZBLOCK"))) {
+            assemble_zblock(lex, *base, addr);
+            break;
+        }
+        if (string_eq(peek_token(lex).str, S("FILL"))) {
+            assemble_fill(lex, *base, addr);
+            break;
+        }
+        if (string_eq(peek_token(lex).str, S("DUBL"))) {
+            assemble_dubl(lex, addr);
+            break;
+        }
         if (string_eq(peek_token(lex).str, S("PAGE"))) {
             next_token(lex);
             int16_t old_addr = *addr;
             if (peek_token(lex).kind == LEX_INT) {
                 Token t = next_token(lex);
                 int16_t n = s_atoi(t.loc, t.str, *base);
-                *addr = (128*n)%(36*128);
+                addr_set = true;
+                *addr = (128*n) & 07777;
             } else {
+                addr_used = true;
                 int16_t round_addr = (*addr)/128*128;
-                *addr = (round_addr+128)%(36*128);
+                *addr = (round_addr+128) & 07777;
             }
             break;
         }
@@ -630,23 +1370,17 @@ void assemble_once(Lexer *lex, Base *base, int16_t *addr) {
         switch (peek_token(lex).kind) {
         case LEX_EQ: {
             int16_t v;
+            bool resolved;
             next_token(lex);
-            Token ve = expect_any(peek_token(lex), LEX_NAME, LEX_INT, LEX_INST);
-            switch (ve.kind) {
-            case LEX_INST: 
-                v = assemble_mnemonic(lex, *base, *addr, &potential_bp.cause);
-                break;
-            case LEX_INT:
-            case LEX_NAME:
-                v = parse_expr(lex, *base, *addr, &potential_bp.cause);
-                break;
-            default: UNREACHABLE();
-            }
-            if (v < 0) da_append(backpatch, potential_bp);
-            else da_append(names, ((NameEntry){t.str, v}));
+            if (peek_token(lex).kind == LEX_INST)
+                resolved = assemble_mnemonics(lex, *base, *addr, &potential_bp.cause, &v);
+            else
+                resolved = parse_expr(lex, *base, *addr, &potential_bp.cause, &v);
+            if (!resolved) da_append(backpatch, potential_bp);
+            else add_name((NameEntry){t.str, v, t.loc, false});
         } break;
         case LEX_COMMA:
-            da_append(names, ((NameEntry){t.str, *addr}));
+            add_name((NameEntry){t.str, *addr, t.loc, true});
             next_token(lex);
             break;
         default: {
@@ -654,76 +1388,59 @@ void assemble_once(Lexer *lex, Base *base, int16_t *addr) {
             *addr = potential_bp.addr;
             *base = potential_bp.base;
             potential_bp.cause = t;
-            int16_t v = parse_expr(lex, *base, *addr, &potential_bp.cause);
-            if (v < 0) {
+            int16_t v;
+            if (!parse_expr(lex, *base, *addr, &potential_bp.cause, &v)) {
                 da_append(backpatch, potential_bp);
                 (*addr)++;
             } else {
-                put_entry_in_ram((*addr)++, potential_bp.cause.loc, v);
+                put_entry_in_ram((*addr)++, t.loc, v);
             }
         } break;
         }
     } break;
-    case LEX_INT: {
-        Token t = next_token(lex);
-        put_entry_in_ram((*addr)++, t.loc, s_atoi(t.loc, t.str, *base));
-    } break;
     case LEX_EQ:
-        fprintf(stderr, "%s:%d:%d\n", PLOC(peek_token(lex).loc));
-        TODO();
-        break;
     case LEX_COMMA:
-        fprintf(stderr, "%s:%d:%d\n", PLOC(peek_token(lex).loc));
-        TODO();
+    case LEX_BANG:
+    case LEX_AMP:
+    case LEX_CARET:
+    case LEX_PERCENT:
+    case LEX_LANGLE:
+    case LEX_PLUS:
+        report_error(peek_token(lex).loc, "Unexpected %s", lex_names[peek_token(lex).kind]);
+        fail();
         break;
-    case LEX_DOT: {
+    case LEX_INT:
+    case LEX_DOT:
+    case LEX_MINUS:
+    case LEX_CHARACTER: {
         BackpatchEntry potential_bp = (BackpatchEntry){
+            .cause = peek_token(lex),
             .addr = *addr,
             .base = *base,
             .lexer = *lex,
         };
-        int16_t v = parse_expr(lex, *base, *addr, &potential_bp.cause);
-        if (v < 0) {
+        Token start = potential_bp.cause;
+        int16_t v;
+        if (!parse_expr(lex, *base, *addr, &potential_bp.cause, &v)) {
             da_append(backpatch, potential_bp);
             (*addr)++;
         } else {
-            put_entry_in_ram((*addr)++, potential_bp.cause.loc, v);
+            put_entry_in_ram((*addr)++, start.loc, v);
         }
     } break;
-    case LEX_MINUS: {
-        BackpatchEntry potential_bp = (BackpatchEntry){
-            .addr = *addr,
-            .base = *base,
-            .lexer = *lex,
-        };
-        next_token(lex);
-        Token t = expect(next_token(lex), LEX_INT);
-        int16_t v = s_atoi(t.loc, t.str, *base);
-        int16_t dv = 0;
-        TokenKind kind;
-        if (is_kind_binop(kind = peek_token(lex).kind))
-            dv = parse_expr(lex, *base, *addr, &potential_bp.cause);
-        if (dv < 0) {
-            da_append(backpatch, potential_bp);
-            (*addr)++;
-        } else {
-            int16_t v = ((1 << 12) - v + dv * (kind == LEX_MINUS ? -1 : 1)) % (1 << 12);
-            put_entry_in_ram((*addr)++, potential_bp.cause.loc, v);
+    case LEX_RANGLE: {
+        Token t = next_token(lex);
+        if (cond_depth == 0) {
+            report_error(t.loc, "Unmatched `>`");
+            fail();
         }
+        cond_depth--;
     } break;
-    case LEX_PLUS:
-        TODO();
-        break;
+    // `;` separates statements on the same line
     case LEX_NEWLINE:
-        next_token(lex);
-        break;
     case LEX_SEMICOLON:
-        TODO();
+        next_token(lex);
         break;
-    case LEX_CHARACTER: {
-        Token t = next_token(lex);
-        put_entry_in_ram((*addr)++, t.loc, t.str.string[0]);
-    } break;
     case LEX_END:
         break;
     }
@@ -736,21 +1453,51 @@ void assemble(Lexer *lex) {
     while (peek_token(lex).kind != LEX_END) {
         assemble_once(lex, &base, &addr);
     }
+    if (cond_depth > 0) {
+        report_error(lex->loc, "Unterminated conditional, expected `>`");
+        fail();
+    }
     size_t bp_count = backpatch.len;
+    backpatching = true;
     for (size_t i = 0; i < bp_count; i++) {
         BackpatchEntry bp = backpatch.data[i];
-        assemble_once(&bp.lexer, &bp.base, &bp.addr);
+        if (bp.fill)
+            backpatch_fill(bp);
+        else
+            assemble_once(&bp.lexer, &bp.base, &bp.addr);
     }
     // if new requests for backpatching were introduced during backpatching,
     // then those are undefined variables
     for (size_t i = bp_count; i < backpatch.len; i++) { 
         BackpatchEntry bp = backpatch.data[i];
-        fprintf(stderr, "%s:%d:%d: Error: Undefined name `%.*s`\n", PLOC(bp.cause.loc), PS(bp.cause.str));
+        report_error(bp.cause.loc, "Error: Undefined name `%.*s`", PS(bp.cause.str));
     }
     if (backpatch.len > bp_count) {
-        exit(1);
+        fail();
+    }
+    bool forward = false;
+    for (size_t i = 0; names_index.size > 0 && i < cond_tests.len; i++) {
+        CondTest test = cond_tests.data[i];
+        // definitions of the name from the latest, the first one outside
+        // of the body is reported
+        NameEntry *first = NULL;
+        for (uint32_t j = *names_slot(test.name.str); j != 0; j = names.data[j - 1].prev) {
+            NameEntry *def = &names.data[j - 1];
+            if (!loc_before(test.body_start, def->loc) || !loc_before(def->loc, test.body_end))
+                first = def;
+        }
+        if (first == NULL) continue;
+        report_error(test.name.loc,
+                     "`%.*s` is tested before its definition at %s:%d:%d "
+                     "(forward references are not allowed in conditions)",
+                     PS(test.name.str), PLOC(first->loc));
+        forward = true;
+    }
+    if (forward) {
+        fail();
     }
     backpatch.len = 0;
+    backpatching = false;
 }
 
 void export_dec_obj(FILE *out) {
@@ -771,6 +1518,1562 @@ void export_dec_obj(FILE *out) {
 #undef O
 }
 
+// Loads `--pst` file on top of current table. It's either an image produced
+// by `--compile-pst`, which replaces the whole table, or text definitions in
+// PAL syntax which extend or replace already loaded mnemonics:
+//   TTINCR=6401         / operate or IOT instruction
+//   FIXMRI TAD=1000     / memory reference instruction
+bool load_pst(char *path) {
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        fprintf(stderr, "Couldn't open `%s`\n", path);
+        return false;
+    }
+    struct stat st;
+    if (fstat(fd, &st) < 0) {
+        fprintf(stderr, "Couldn't stat `%s`\n", path);
+        close(fd);
+        return false;
+    }
+    size_t size = st.st_size;
+    char *data = mmap(NULL, size ? size : 1, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED) {
+        fprintf(stderr, "Couldn't mmap `%s`\n", path);
+        return false;
+    }
+    if (size >= sizeof(PstImage) && memcmp(data, "GPST", 4) == 0) {
+        PstImage *image = (PstImage *)data;
+        bool valid = image->version == PST_VERSION && image->size != 0 &&
+                     (image->size & (image->size - 1)) == 0 && image->count < image->size &&
+                     size == pst_image_size(image->size);
+        // lookups stop at an empty slot, so there must be at least one
+        uint32_t used = 0;
+        for (uint32_t i = 0; valid && i < image->size; i++) {
+            PstEntry *e = &image->slots[i];
+            if (e->name[0] == 0) continue;
+            used++;
+            valid = pst_name_length(e) <= PST_NAME_MAX && e->kind <= T_MEM_REF && e->opcode <= 07777;
+        }
+        if (!valid || used != image->count) {
+            fprintf(stderr, "`%s` is not a valid PST image, recompile it with --compile-pst\n", path);
+            munmap(data, size);
+            return false;
+        }
+        pst_release();
+        pst = image;
+        pst_mapped = true;
+        return true;
+    }
+
+    // text definitions, copied so lexer always sees "\n\0" at the end
+    char *text = malloc(size + 2);
+    assert(text != NULL);
+    memcpy(text, data, size);
+    munmap(data, size ? size : 1);
+    text[size] = '\n';
+    text[size + 1] = '\0';
+    Lexer lex = (Lexer){
+        .len = size + 1,
+        .code = text,
+        .loc = (Loc){0, 0, path},
+    };
+    for (Token t; (t = next_token(&lex)).kind != LEX_END;) {
+        if (t.kind == LEX_NEWLINE) continue;
+        InstKind kind = T_DEFAULT;
+        if (t.kind == LEX_NAME && string_eq(t.str, S("FIXMRI"))) {
+            kind = T_MEM_REF;
+            t = next_token(&lex);
+        }
+        Token name = expect_any(t, LEX_NAME, LEX_INST);
+        if (name.str.length > PST_NAME_MAX) {
+            report_error(name.loc, "Mnemonic `%.*s` is longer than %d characters",
+                         PS(name.str), PST_NAME_MAX);
+            fail();
+        }
+        expect(next_token(&lex), LEX_EQ);
+        Token value = expect(next_token(&lex), LEX_INT);
+        expect_any(peek_token(&lex), LEX_NEWLINE, LEX_END);
+        pst_insert(name.str, s_atoi(value.loc, value.str, B_OCT) & 07777, kind, true);
+    }
+    free(text);
+    return true;
+}
+
+// `--compile-pst` writes current table (builtin with `file` loaded on top),
+// so it can be mmap'ed with `--pst` later
+bool compile_pst(char *file, char *output_file) {
+    if (!load_pst(file)) return false;
+    FILE *f = fopen(output_file, "wb");
+    if (f == NULL) {
+        fprintf(stderr, "Couldn't open `%s`\n", output_file);
+        return false;
+    }
+    fwrite(pst, 1, pst_image_size(pst->size), f);
+    fclose(f);
+    return true;
+}
+
+// Symbol and line map for debuggers, designed to be mmap'ed and searched
+// in place. All fields are little-endian uint32 unless noted:
+//
+//   header:  magic "GMAP", version, file_length, symbol_count, pool_size
+//   lines:   4096 entries, source line (1-based) of each address, 0 if unused
+//   symbols: symbol_count entries of
+//              name_offset, name_length (u16), value (u16), line (1-based),
+//              flags (MAP_LABEL)
+//            labels first, then equates, each sorted by value, then by name
+//   pool:    source file name (file_length bytes) followed by symbol names
+#define MAP_VERSION 2
+#define MAP_LABEL 1
+
+static void put_u16(FILE *out, uint16_t v) {
+    fputc(v & 0xFF, out);
+    fputc(v >> 8, out);
+}
+
+static void put_u32(FILE *out, uint32_t v) {
+    put_u16(out, v & 0xFFFF);
+    put_u16(out, v >> 16);
+}
+
+static int string_cmp(String s1, String s2) {
+    int n = s1.length < s2.length ? s1.length : s2.length;
+    int r = memcmp(s1.string, s2.string, n);
+    if (r != 0) return r;
+    return s1.length - s2.length;
+}
+
+static int compare_names_by_name(const void *a, const void *b) {
+    const NameEntry *x = a, *y = b;
+    return string_cmp(x->name, y->name);
+}
+
+static int compare_names_by_value(const void *a, const void *b) {
+    const NameEntry *x = a, *y = b;
+    if (x->label != y->label) return y->label - x->label;
+    if (x->value != y->value) return x->value - y->value;
+    return compare_names_by_name(a, b);
+}
+
+// orders pointers into `names` by name, then by order of definition
+static int compare_name_ptrs(const void *a, const void *b) {
+    const NameEntry *x = *(NameEntry *const *)a, *y = *(NameEntry *const *)b;
+    int r = compare_names_by_name(x, y);
+    if (r != 0) return r;
+    return (x > y) - (x < y);
+}
+
+// Returns final definitions of all names sorted by value, caller frees
+static NameEntry *collect_symbols(size_t *count) {
+    NameEntry **sorted = malloc(sizeof(*sorted) * (names.len + 1));
+    NameEntry *symbols = malloc(sizeof(*symbols) * (names.len + 1));
+    assert(sorted != NULL && symbols != NULL);
+    for (size_t i = 0; i < names.len; i++)
+        sorted[i] = &names.data[i];
+    qsort(sorted, names.len, sizeof(*sorted), compare_name_ptrs);
+    size_t n = 0;
+    // names are looked up from the end, so only the last definition counts
+    for (size_t i = 0; i < names.len; i++) {
+        if (i + 1 < names.len && string_eq(sorted[i]->name, sorted[i + 1]->name))
+            continue;
+        symbols[n++] = *sorted[i];
+    }
+    free(sorted);
+    qsort(symbols, n, sizeof(*symbols), compare_names_by_value);
+    *count = n;
+    return symbols;
+}
+
+void export_map(FILE *out, char *file) {
+    size_t count;
+    NameEntry *symbols = collect_symbols(&count);
+    uint32_t file_length = strlen(file), pool_size = file_length;
+    for (size_t i = 0; i < count; i++)
+        pool_size += symbols[i].name.length;
+
+    fwrite("GMAP", 1, 4, out);
+    put_u32(out, MAP_VERSION);
+    put_u32(out, file_length);
+    put_u32(out, count);
+    put_u32(out, pool_size);
+    for (size_t i = 0; i < ARRLEN(ram); i++)
+        put_u32(out, ram[i].used ? ram[i].loc.line + 1 : 0);
+    uint32_t offset = file_length;
+    for (size_t i = 0; i < count; i++) {
+        put_u32(out, offset);
+        put_u16(out, symbols[i].name.length);
+        put_u16(out, symbols[i].value & 07777);
+        put_u32(out, symbols[i].loc.line + 1);
+        put_u32(out, symbols[i].label ? MAP_LABEL : 0);
+        offset += symbols[i].name.length;
+    }
+    fwrite(file, 1, file_length, out);
+    for (size_t i = 0; i < count; i++)
+        fwrite(symbols[i].name.string, 1, symbols[i].name.length, out);
+    free(symbols);
+}
+
+void export_map_text(FILE *out, char *file) {
+    size_t count;
+    NameEntry *symbols = collect_symbols(&count);
+    fprintf(out, "/ symbols\n");
+    for (size_t i = 0; i < count; i++)
+        fprintf(out, "%04o %-8.*s %c %s:%d\n", symbols[i].value & 07777,
+                PS(symbols[i].name), symbols[i].label ? ',' : '=', file, symbols[i].loc.line + 1);
+    fprintf(out, "/ lines\n");
+    for (size_t i = 0; i < ARRLEN(ram); i++) {
+        if (ram[i].used)
+            fprintf(out, "%04zo %04o %s:%d\n", i, ram[i].v, file, ram[i].loc.line + 1);
+    }
+    free(symbols);
+}
+
+static int compare_refs(const void *a, const void *b) {
+    const NameRef *x = a, *y = b;
+    int r = string_cmp(x->name, y->name);
+    if (r != 0) return r;
+    return (x->loc.line > y->loc.line) - (x->loc.line < y->loc.line);
+}
+
+// Listing of the source with line number, address and assembled word(s)
+// in front of every line
+void export_listing(FILE *out, String source) {
+    // words grouped by source line, in address order
+    int lines = 1;
+    for (size_t i = 0; i < ARRLEN(ram); i++)
+        if (ram[i].used && (int)ram[i].loc.line + 1 > lines) lines = ram[i].loc.line + 1;
+    int *first = calloc(lines + 1, sizeof(*first));
+    int16_t *addrs = malloc(sizeof(*addrs) * ARRLEN(ram));
+    assert(first != NULL && addrs != NULL);
+    for (size_t i = 0; i < ARRLEN(ram); i++)
+        if (ram[i].used) first[ram[i].loc.line + 1]++;
+    for (int i = 0; i < lines; i++)
+        first[i + 1] += first[i];
+    int *next = calloc(lines, sizeof(*next));
+    assert(next != NULL);
+    for (size_t i = 0; i < ARRLEN(ram); i++)
+        if (ram[i].used) addrs[first[ram[i].loc.line] + next[ram[i].loc.line]++] = i;
+
+    int line = 0;
+    char *p = source.string, *end = source.string + source.length;
+    while (p < end) {
+        char *eol = memchr(p, '\n', end - p);
+        if (eol == NULL) eol = end;
+        String text = {p, (int)(eol - p)};
+        int from = line < lines ? first[line] : 0, to = line < lines ? first[line + 1] : 0;
+        if (from == to) {
+            fprintf(out, "%5d           %.*s\n", line + 1, PS(text));
+        } else {
+            fprintf(out, "%5d %04o %04o %.*s\n", line + 1, addrs[from], ram[addrs[from]].v, PS(text));
+            for (int i = from + 1; i < to; i++)
+                fprintf(out, "      %04o %04o\n", addrs[i], ram[addrs[i]].v);
+        }
+        p = eol + 1;
+        line++;
+    }
+    free(first);
+    free(next);
+    free(addrs);
+}
+
+// Cross-reference: every symbol with its value, line of definition and
+// lines where it's used
+void export_xref(FILE *out) {
+    size_t count;
+    NameEntry *symbols = collect_symbols(&count);
+    qsort(symbols, count, sizeof(*symbols), compare_names_by_name);
+    NameRef *uses = malloc(sizeof(*uses) * (refs.len + 1));
+    assert(uses != NULL);
+    if (refs.len) memcpy(uses, refs.data, sizeof(*uses) * refs.len);
+    qsort(uses, refs.len, sizeof(*uses), compare_refs);
+    size_t u = 0;
+    for (size_t i = 0; i < count; i++) {
+        fprintf(out, "%-8.*s %04o %5d", PS(symbols[i].name), symbols[i].value & 07777,
+                symbols[i].loc.line + 1);
+        // both arrays are sorted by name
+        while (u < refs.len && string_cmp(uses[u].name, symbols[i].name) < 0)
+            u++;
+        for (; u < refs.len && string_eq(uses[u].name, symbols[i].name); u++)
+            fprintf(out, " %d", uses[u].loc.line + 1);
+        fputc('\n', out);
+    }
+    free(uses);
+    free(symbols);
+}
+
+// ---- language server ----
+// `gal --lsp` speaks LSP over stdio. Documents are kept in incremental sync
+// and assembled incrementally, see below.
+
+typedef struct {
+    char *data;
+    size_t len, cap;
+} StringBuilder;
+
+static void sb_appendf(StringBuilder *sb, const char *fmt, ...) {
+    va_list args;
+    va_start(args, fmt);
+    va_list copy;
+    va_copy(copy, args);
+    int n = vsnprintf(NULL, 0, fmt, copy);
+    va_end(copy);
+    if (sb->len + n + 1 > sb->cap) {
+        while (sb->len + n + 1 > sb->cap)
+            sb->cap = sb->cap ? sb->cap * 2 : 256;
+        sb->data = realloc(sb->data, sb->cap);
+        assert(sb->data != NULL);
+    }
+    vsnprintf(sb->data + sb->len, n + 1, fmt, args);
+    sb->len += n;
+    va_end(args);
+}
+
+static void sb_append_json_string(StringBuilder *sb, String s) {
+    sb_appendf(sb, "\"");
+    for (int i = 0; i < s.length; i++) {
+        char c = s.string[i];
+        switch (c) {
+        case '"':  sb_appendf(sb, "\\\""); break;
+        case '\\': sb_appendf(sb, "\\\\"); break;
+        case '\n': sb_appendf(sb, "\\n"); break;
+        case '\r': sb_appendf(sb, "\\r"); break;
+        case '\t': sb_appendf(sb, "\\t"); break;
+        default:
+            if ((unsigned char)c < 0x20) sb_appendf(sb, "\\u%04x", c);
+            else sb_appendf(sb, "%c", c);
+        }
+    }
+    sb_appendf(sb, "\"");
+}
+
+// returns index just past the value starting at `j`
+static int json_value_end(String json, int j) {
+    int depth = 0;
+    bool in_string = false;
+    for (; j < json.length; j++) {
+        char c = json.string[j];
+        if (in_string) {
+            if (c == '\\') {
+                j++;
+            } else if (c == '"') {
+                in_string = false;
+                if (depth == 0) { j++; break; }
+            }
+        } else if (c == '"') {
+            in_string = true;
+        } else if (c == '{' || c == '[') {
+            depth++;
+        } else if (c == '}' || c == ']') {
+            if (depth-- == 0) break;
+            if (depth == 0) { j++; break; }
+        } else if (c == ',' && depth == 0) {
+            break;
+        }
+    }
+    return j;
+}
+
+// Finds the first member called `key` at any depth and returns its raw value.
+// LSP messages we handle never have ambiguous keys, so it's good enough.
+static bool json_get(String json, const char *key, String *out) {
+    int klen = strlen(key);
+    for (int i = 0; i + klen + 2 <= json.length; i++) {
+        char *p = json.string + i;
+        if (*p != '"' || (i > 0 && p[-1] == '\\')) continue;
+        if (memcmp(p + 1, key, klen) != 0 || p[klen + 1] != '"') continue;
+        int j = i + klen + 2;
+        while (j < json.length && isspace(json.string[j])) j++;
+        if (j >= json.length || json.string[j] != ':') continue;
+        j++;
+        while (j < json.length && isspace(json.string[j])) j++;
+        int start = j;
+        j = json_value_end(json, j);
+        *out = string_strip((String){json.string + start, j - start});
+        return true;
+    }
+    return false;
+}
+
+// Iterates elements of a raw JSON array, `rest` starts as the whole array
+static bool json_next_element(String *rest, String *out) {
+    int j = 0;
+    while (j < rest->length && (isspace(rest->string[j]) || rest->string[j] == '[' ||
+                                rest->string[j] == ','))
+        j++;
+    if (j >= rest->length || rest->string[j] == ']') return false;
+    int end = json_value_end(*rest, j);
+    *out = string_strip((String){rest->string + j, end - j});
+    rest->string += end;
+    rest->length -= end;
+    return true;
+}
+
+static int json_get_int(String json, const char *key) {
+    String v;
+    if (!json_get(json, key, &v)) return 0;
+    return atoi(v.string);
+}
+
+// Decodes a JSON string into a newly allocated C string, returns NULL if
+// `key` is missing or isn't a string.
+static char *json_get_string(String json, const char *key, size_t *length) {
+    String v;
+    if (!json_get(json, key, &v) || v.length < 2 || v.string[0] != '"')
+        return NULL;
+    char *result = malloc(v.length + 1), *o = result;
+    assert(result != NULL);
+    for (int i = 1; i < v.length - 1; i++) {
+        char c = v.string[i];
+        if (c != '\\') {
+            *o++ = c;
+            continue;
+        }
+        switch (c = v.string[++i]) {
+        case 'n': *o++ = '\n'; break;
+        case 't': *o++ = '\t'; break;
+        case 'r': *o++ = '\r'; break;
+        case 'b': *o++ = '\b'; break;
+        case 'f': *o++ = '\f'; break;
+        case 'u': {
+            char hex[5] = {0};
+            memcpy(hex, v.string + i + 1, 4);
+            i += 4;
+            unsigned cp = strtoul(hex, NULL, 16);
+            if (cp < 0x80) {
+                *o++ = cp;
+            } else if (cp < 0x800) {
+                *o++ = 0xC0 | (cp >> 6);
+                *o++ = 0x80 | (cp & 0x3F);
+            } else {
+                *o++ = 0xE0 | (cp >> 12);
+                *o++ = 0x80 | ((cp >> 6) & 0x3F);
+                *o++ = 0x80 | (cp & 0x3F);
+            }
+        } break;
+        default: *o++ = c; break;
+        }
+    }
+    *o = '\0';
+    if (length) *length = o - result;
+    return result;
+}
+
+// ---- incremental assembly ----
+// The language server splits a document into chunks, normally one line each,
+// a skipped conditional body makes a chunk span several lines. A chunk keeps
+// the state it was assembled in (address, base, conditional depth) and what
+// it produced: tokens, definitions, uses, words, backpatch entries,
+// diagnostics and results of the name lookups it made.
+//
+// Symbols are in a hash table, every symbol has its definitions in source
+// order and the chunks which looked it up. Lookups give the same results as
+// find_name() in assemble(): the first pass sees earlier definitions made in
+// the first pass, backpatching sees earlier backpatched definitions and then
+// the last one made in the first pass.
+//
+// An edit drops the chunks covering changed lines and assembles the new
+// lines. After that a chunk is assembled again only if its start state
+// changed or one of its lookups has a different result, so only uses of
+// the names which changed are resolved again. Unlike assemble(), an error
+// stops only its own chunk.
+
+typedef struct {
+    char *text; // ends with "\n\0"
+    int len;    // including '\n'
+} Line;
+
+typedef struct Symbol Symbol;
+
+typedef struct {
+    Symbol *symbol;
+    bool found;
+    int16_t value;
+    size_t dep; // index in `symbol->deps`
+} Lookup;
+
+// first pass and backpatching
+#define PASSES 2
+
+struct Chunk {
+    int line, lines;
+    char *text;
+    size_t len;
+    // otherwise `text` is the text of the only line
+    bool own_text;
+    // state at the start and at the end of the chunk
+    int16_t addr, end_addr;
+    Base base, end_base;
+    int cond_depth, end_cond_depth;
+    // otherwise the pass only placed words and labels relative to `addr`,
+    // see chunk_move()
+    bool uses_addr[PASSES];
+    bool sets_addr;
+    bool assembled, ends_program, dead, backpatch_stale;
+    bool queued[PASSES];
+    // lines of locations are relative to the first line of the chunk
+    struct { Token *data; size_t len, cap; } tokens;
+    struct { NameRef *data; size_t len, cap; } refs;
+    struct { BackpatchEntry *data; size_t len, cap; } backpatch;
+    struct { CondTest *data; size_t len, cap; } cond_tests;
+    struct { NameEntry *data; size_t len, cap; } defs[PASSES];
+    struct { Lookup *data; size_t len, cap; } lookups[PASSES];
+    struct { Word *data; size_t len, cap; } words[PASSES];
+    struct { Diagnostic *data; size_t len, cap; } diags[PASSES];
+};
+
+typedef struct {
+    Chunk *chunk;
+    int pass;
+    size_t index; // in `chunk->defs[pass]` or `chunk->lookups[pass]`
+} ChunkRef;
+
+struct Symbol {
+    String name;
+    // in source order
+    struct { ChunkRef *data; size_t len, cap; } defs;
+    // lookups of the name
+    struct { ChunkRef *data; size_t len, cap; } deps;
+};
+
+typedef struct {
+    char *uri;
+    struct { Line *data; size_t len, cap; } lines;
+    // in order, they cover the document up to the end of the program
+    struct { Chunk **data; size_t len, cap; } chunks;
+    struct { Symbol **slots; size_t size, count; } symbols;
+    // chunks to revisit are marked `queued`, none of them is before `first`
+    size_t queued[PASSES];
+    int first[PASSES];
+    struct { Chunk **data; size_t len, cap; } dead;
+    // diagnostics of the whole document, lines are absolute
+    struct { Diagnostic *data; size_t len, cap; } diags;
+    size_t chunk_diags, cond_tests;
+    // words put at every address, overlaps is number of addresses used twice
+    int ram_count[4096];
+    int overlaps;
+} Document;
+
+Document *current_doc = NULL;
+
+#define da_free(xs)                                                            \
+    do {                                                                       \
+        free((xs).data);                                                       \
+        (xs).data = NULL;                                                      \
+        (xs).len = (xs).cap = 0;                                               \
+    } while (0)
+
+// moves contents of `src` into empty `dst` of the same element type
+#define da_move(dst, src)                                                      \
+    do {                                                                       \
+        (dst).len = (dst).cap = (src).len;                                     \
+        (dst).data = NULL;                                                     \
+        if ((src).len > 0) {                                                   \
+            (dst).data = malloc(sizeof(*(dst).data) * (src).len);              \
+            assert((dst).data != NULL);                                        \
+            memcpy((dst).data, (src).data, sizeof(*(dst).data) * (src).len);   \
+        }                                                                      \
+        (src).len = 0;                                                         \
+    } while (0)
+
+static Symbol *symbol_get(Document *doc, String name, bool create) {
+    if (create && (doc->symbols.count + 1) * 2 > doc->symbols.size) {
+        size_t size = doc->symbols.size ? doc->symbols.size * 2 : 1024;
+        Symbol **slots = calloc(size, sizeof(*slots));
+        assert(slots != NULL);
+        for (size_t i = 0; i < doc->symbols.size; i++) {
+            Symbol *s = doc->symbols.slots[i];
+            if (s == NULL) continue;
+            size_t j = string_hash(s->name) & (size - 1);
+            while (slots[j] != NULL) j = (j + 1) & (size - 1);
+            slots[j] = s;
+        }
+        free(doc->symbols.slots);
+        doc->symbols.slots = slots;
+        doc->symbols.size = size;
+    }
+    if (doc->symbols.size == 0) return NULL;
+    size_t mask = doc->symbols.size - 1, i = string_hash(name) & mask;
+    for (; doc->symbols.slots[i] != NULL; i = (i + 1) & mask) {
+        if (string_eq(doc->symbols.slots[i]->name, name))
+            return doc->symbols.slots[i];
+    }
+    if (!create) return NULL;
+    Symbol *s = calloc(1, sizeof(*s));
+    assert(s != NULL);
+    s->name = (String){malloc(name.length), name.length};
+    assert(s->name.string != NULL);
+    memcpy(s->name.string, name.string, name.length);
+    doc->symbols.slots[i] = s;
+    doc->symbols.count++;
+    return s;
+}
+
+static inline NameEntry *def_entry(ChunkRef d) {
+    return &d.chunk->defs[d.pass].data[d.index];
+}
+
+// Value of the name as seen by a chunk starting at `line`. Definitions made
+// in the chunk itself are in `names` and are searched before.
+static bool symbol_lookup(Symbol *s, int line, int pass, int16_t *out) {
+    for (size_t i = s->defs.len; i-- > 0;) {
+        ChunkRef d = s->defs.data[i];
+        if (d.pass == pass && d.chunk->line < line) {
+            *out = def_entry(d)->value;
+            return true;
+        }
+    }
+    if (pass == 0) return false;
+    for (size_t i = s->defs.len; i-- > 0;) {
+        if (s->defs.data[i].pass == 0) {
+            *out = def_entry(s->defs.data[i])->value;
+            return true;
+        }
+    }
+    return false;
+}
+
+static bool chunk_find_name(int16_t *out, String name) {
+    Chunk *c = current_chunk;
+    int pass = backpatching;
+    Symbol *s = symbol_get(current_doc, name, true);
+    int16_t v = 0;
+    bool found = symbol_lookup(s, c->line, pass, &v);
+    size_t i = 0;
+    while (i < c->lookups[pass].len && c->lookups[pass].data[i].symbol != s)
+        i++;
+    if (i == c->lookups[pass].len) {
+        da_append(s->deps, ((ChunkRef){c, pass, i}));
+        da_append(c->lookups[pass], ((Lookup){s, found, v, s->deps.len - 1}));
+    }
+    for (i = names.len; i-- > 0;) {
+        if (string_eq(names.data[i].name, name)) {
+            *out = names.data[i].value;
+            return true;
+        }
+    }
+    if (found) *out = v;
+    return found;
+}
+
+static void remove_lookups(Chunk *c, int pass) {
+    for (size_t i = 0; i < c->lookups[pass].len; i++) {
+        Lookup l = c->lookups[pass].data[i];
+        Symbol *s = l.symbol;
+        ChunkRef last = s->deps.data[--s->deps.len];
+        if (l.dep < s->deps.len) {
+            s->deps.data[l.dep] = last;
+            last.chunk->lookups[last.pass].data[last.index].dep = l.dep;
+        }
+    }
+    c->lookups[pass].len = 0;
+}
+
+static bool lookups_changed(Chunk *c, int pass) {
+    for (size_t i = 0; i < c->lookups[pass].len; i++) {
+        Lookup l = c->lookups[pass].data[i];
+        int16_t v = 0;
+        bool found = symbol_lookup(l.symbol, c->line, pass, &v);
+        if (found != l.found || v != l.value) return true;
+    }
+    return false;
+}
+
+static void schedule(Document *doc, Chunk *c, int pass) {
+    if (c->dead || c->queued[pass]) return;
+    c->queued[pass] = true;
+    doc->queued[pass]++;
+    if (c->line < doc->first[pass]) doc->first[pass] = c->line;
+}
+
+// schedules chunks which looked up names defined in `defs`
+static void defs_changed(Document *doc, NameEntry *defs, size_t count, int pass) {
+    for (size_t i = 0; i < count; i++) {
+        Symbol *s = symbol_get(doc, defs[i].name, false);
+        if (s == NULL) continue;
+        for (size_t j = 0; j < s->deps.len; j++) {
+            ChunkRef d = s->deps.data[j];
+            // the first pass doesn't see backpatched definitions
+            if (pass == 0 || d.pass == 1)
+                schedule(doc, d.chunk, d.pass);
+        }
+    }
+}
+
+static void add_defs(Document *doc, Chunk *c, int pass) {
+    for (size_t i = 0; i < c->defs[pass].len; i++) {
+        Symbol *s = symbol_get(doc, c->defs[pass].data[i].name, true);
+        size_t at = s->defs.len;
+        while (at > 0 && s->defs.data[at - 1].chunk->line > c->line)
+            at--;
+        da_append(s->defs, ((ChunkRef){0}));
+        memmove(&s->defs.data[at + 1], &s->defs.data[at], sizeof(ChunkRef) * (s->defs.len - 1 - at));
+        s->defs.data[at] = (ChunkRef){c, pass, i};
+    }
+}
+
+static void remove_defs(Document *doc, Chunk *c, int pass) {
+    for (size_t i = 0; i < c->defs[pass].len; i++) {
+        Symbol *s = symbol_get(doc, c->defs[pass].data[i].name, false);
+        size_t j = 0;
+        while (s->defs.data[j].chunk != c || s->defs.data[j].pass != pass || s->defs.data[j].index != i)
+            j++;
+        memmove(&s->defs.data[j], &s->defs.data[j + 1], sizeof(ChunkRef) * (s->defs.len - j - 1));
+        s->defs.len--;
+    }
+}
+
+// replaces definitions of a pass with ones in `names`
+static void set_defs(Document *doc, Chunk *c, int pass) {
+    bool same = c->defs[pass].len == names.len;
+    for (size_t i = 0; same && i < names.len; i++) {
+        same = string_eq(c->defs[pass].data[i].name, names.data[i].name) &&
+               c->defs[pass].data[i].value == names.data[i].value;
+    }
+    if (!same) {
+        defs_changed(doc, c->defs[pass].data, c->defs[pass].len, pass);
+        remove_defs(doc, c, pass);
+    }
+    da_free(c->defs[pass]);
+    da_move(c->defs[pass], names);
+    if (!same) {
+        add_defs(doc, c, pass);
+        defs_changed(doc, c->defs[pass].data, c->defs[pass].len, pass);
+    }
+}
+
+static void count_words(Document *doc, Chunk *c, int pass, int delta) {
+    for (size_t i = 0; i < c->words[pass].len; i++) {
+        Word w = c->words[pass].data[i];
+        if (w.update) continue;
+        for (int addr = w.addr; addr < w.addr + w.count; addr++) {
+            int *n = &doc->ram_count[addr];
+            if (delta > 0 && ++*n == 2) doc->overlaps++;
+            if (delta < 0 && (*n)-- == 2) doc->overlaps--;
+        }
+    }
+}
+
+static void free_diags(Document *doc, Chunk *c, int pass) {
+    for (size_t i = 0; i < c->diags[pass].len; i++)
+        free(c->diags[pass].data[i].message);
+    doc->chunk_diags -= c->diags[pass].len;
+    da_free(c->diags[pass]);
+}
+
+// removes results of a pass from the document, except definitions, which
+// are compared with the new ones by set_defs()
+static void chunk_clear(Document *doc, Chunk *c, int pass) {
+    remove_lookups(c, pass);
+    count_words(doc, c, pass, -1);
+    da_free(c->words[pass]);
+    free_diags(doc, c, pass);
+    if (pass == 0) {
+        da_free(c->tokens);
+        da_free(c->refs);
+        da_free(c->backpatch);
+        doc->cond_tests -= c->cond_tests.len;
+        da_free(c->cond_tests);
+    }
+}
+
+static void chunk_drop(Document *doc, Chunk *c) {
+    for (int pass = 0; pass < PASSES; pass++) {
+        chunk_clear(doc, c, pass);
+        remove_defs(doc, c, pass);
+        defs_changed(doc, c->defs[pass].data, c->defs[pass].len, pass);
+        if (c->queued[pass]) doc->queued[pass]--;
+    }
+    c->dead = true;
+    da_append(doc->dead, c);
+}
+
+static void chunk_free(Chunk *c) {
+    for (int pass = 0; pass < PASSES; pass++) {
+        for (size_t i = 0; i < c->diags[pass].len; i++)
+            free(c->diags[pass].data[i].message);
+        free(c->defs[pass].data);
+        free(c->lookups[pass].data);
+        free(c->words[pass].data);
+        free(c->diags[pass].data);
+    }
+    free(c->tokens.data);
+    free(c->refs.data);
+    free(c->backpatch.data);
+    free(c->cond_tests.data);
+    if (c->own_text) free(c->text);
+    free(c);
+}
+
+// index of the last chunk starting at or before `line`, chunks.len if none
+static size_t chunk_index(Document *doc, int line) {
+    size_t lo = 0, hi = doc->chunks.len;
+    while (lo < hi) {
+        size_t mid = (lo + hi) / 2;
+        if (doc->chunks.data[mid]->line <= line) lo = mid + 1;
+        else hi = mid;
+    }
+    return lo == 0 ? doc->chunks.len : lo - 1;
+}
+
+static Chunk *chunk_at(Document *doc, int line) {
+    size_t i = chunk_index(doc, line);
+    if (i == doc->chunks.len) return NULL;
+    Chunk *c = doc->chunks.data[i];
+    return line < c->line + c->lines ? c : NULL;
+}
+
+static void chunk_insert(Document *doc, size_t i, int line) {
+    Chunk *c = calloc(1, sizeof(*c));
+    assert(c != NULL);
+    c->line = line;
+    c->lines = 1;
+    da_append(doc->chunks, c);
+    memmove(&doc->chunks.data[i + 1], &doc->chunks.data[i], sizeof(Chunk *) * (doc->chunks.len - 1 - i));
+    doc->chunks.data[i] = c;
+    schedule(doc, c, 0);
+}
+
+// returns number of lines the text has
+static int chunk_set_text(Document *doc, Chunk *c, int lines) {
+    if (c->own_text) free(c->text);
+    if (c->line + lines > (int)doc->lines.len) lines = doc->lines.len - c->line;
+    Line *first = &doc->lines.data[c->line];
+    c->own_text = lines > 1;
+    if (!c->own_text) {
+        c->text = first->text;
+        c->len = first->len;
+        return lines;
+    }
+    c->len = 0;
+    for (int i = 0; i < lines; i++)
+        c->len += first[i].len;
+    c->text = malloc(c->len + 1);
+    assert(c->text != NULL);
+    char *p = c->text;
+    for (int i = 0; i < lines; i++) {
+        memcpy(p, first[i].text, first[i].len);
+        p += first[i].len;
+    }
+    *p = '\0';
+    return lines;
+}
+
+static void reset_scratch(void) {
+    names.len = 0;
+    refs.len = 0;
+    backpatch.len = 0;
+    cond_tests.len = 0;
+    words.len = 0;
+    tokens.len = 0;
+    tokens_end = NULL;
+    for (size_t i = 0; i < diagnostics.len; i++)
+        free(diagnostics.data[i].message);
+    diagnostics.len = 0;
+}
+
+static jmp_buf chunk_jmp;
+// state of the chunk being assembled is kept out of the stack, so that it's
+// intact after an error unwinds
+static Lexer chunk_lexer;
+static int16_t chunk_addr;
+static Base chunk_base;
+
+// First pass over the chunk, it ends at the end of a line where its last
+// statement ends
+static void chunk_assemble(Document *doc, Chunk *c) {
+    // old definitions point into the old text until set_defs()
+    char *old_text = c->own_text ? c->text : NULL;
+    c->own_text = false;
+    chunk_clear(doc, c, 0);
+    current_chunk = c;
+    error_jmp = &chunk_jmp;
+    int lines = 1, available;
+    bool failed;
+    for (;;) {
+        available = chunk_set_text(doc, c, lines);
+        reset_scratch();
+        remove_lookups(c, 0);
+        chunk_lexer = (Lexer){
+            .len = c->len,
+            .code = c->text,
+            .loc = (Loc){0, 0, doc->uri},
+        };
+        chunk_addr = c->addr;
+        chunk_base = c->base;
+        cond_depth = c->cond_depth;
+        addr_used = addr_set = false;
+        c->ends_program = false;
+        failed = setjmp(chunk_jmp) != 0;
+        while (!failed) {
+            Token t = peek_token(&chunk_lexer);
+            if (t.kind == LEX_END) {
+                c->ends_program = t.str.length > 0;
+                break;
+            }
+            assemble_once(&chunk_lexer, &chunk_base, &chunk_addr);
+            if (chunk_lexer.code[-1] == '\n') break;
+        }
+        // skipped conditional body continues on the following lines
+        if (failed && chunk_lexer.len == 0 && lines < (int)doc->lines.len - c->line) {
+            lines *= 2;
+            continue;
+        }
+        break;
+    }
+    error_jmp = NULL;
+    int n = chunk_lexer.loc.line;
+    if (chunk_lexer.code == c->text || chunk_lexer.code[-1] != '\n') n++;
+    c->lines = n < available ? n : available;
+    c->end_addr = chunk_addr;
+    c->end_base = chunk_base;
+    c->end_cond_depth = cond_depth;
+    // error messages may have addresses
+    c->uses_addr[0] = addr_used || diagnostics.len > 0;
+    c->sets_addr = addr_set;
+    da_move(c->tokens, tokens);
+    da_move(c->refs, refs);
+    da_move(c->backpatch, backpatch);
+    da_move(c->cond_tests, cond_tests);
+    doc->cond_tests += c->cond_tests.len;
+    da_move(c->words[0], words);
+    count_words(doc, c, 0, 1);
+    da_move(c->diags[0], diagnostics);
+    doc->chunk_diags += c->diags[0].len;
+    set_defs(doc, c, 0);
+    current_chunk = NULL;
+    free(old_text);
+    c->assembled = true;
+    c->backpatch_stale = true;
+    schedule(doc, c, 1);
+}
+
+static void chunk_backpatch(Document *doc, Chunk *c) {
+    chunk_clear(doc, c, 1);
+    reset_scratch();
+    current_chunk = c;
+    backpatching = true;
+    addr_used = false;
+    error_jmp = &chunk_jmp;
+    for (size_t i = 0; i < c->backpatch.len; i++) {
+        if (setjmp(chunk_jmp) != 0) continue;
+        BackpatchEntry bp = c->backpatch.data[i];
+        if (bp.fill)
+            backpatch_fill(bp);
+        else
+            assemble_once(&bp.lexer, &bp.base, &bp.addr);
+    }
+    // as in assemble(), entries added while backpatching are undefined names
+    for (size_t i = 0; i < backpatch.len; i++) {
+        BackpatchEntry bp = backpatch.data[i];
+        report_error(bp.cause.loc, "Error: Undefined name `%.*s`", PS(bp.cause.str));
+    }
+    backpatch.len = 0;
+    error_jmp = NULL;
+    backpatching = false;
+    c->uses_addr[1] = addr_used || diagnostics.len > 0;
+    da_move(c->words[1], words);
+    count_words(doc, c, 1, 1);
+    da_move(c->diags[1], diagnostics);
+    doc->chunk_diags += c->diags[1].len;
+    set_defs(doc, c, 1);
+    current_chunk = NULL;
+    c->backpatch_stale = false;
+}
+
+// Moves the chunk to start at `addr` without assembling it again, if it
+// only placed words and labels there
+static bool chunk_move(Document *doc, Chunk *c, int16_t addr) {
+    if (c->uses_addr[0]) return false;
+    if (c->sets_addr) {
+        if (c->words[0].len > 0 || c->backpatch.len > 0 || c->defs[0].len > 0)
+            return false;
+        c->addr = addr;
+        return true;
+    }
+    int delta = addr - c->addr;
+    if (addr < 0 || c->end_addr + delta > 07777) return false;
+    for (int pass = 0; pass < PASSES; pass++) {
+        count_words(doc, c, pass, -1);
+        for (size_t i = 0; i < c->words[pass].len; i++)
+            c->words[pass].data[i].addr += delta;
+        count_words(doc, c, pass, 1);
+        bool labels = false;
+        for (size_t i = 0; i < c->defs[pass].len; i++) {
+            NameEntry *def = &c->defs[pass].data[i];
+            if (!def->label) continue;
+            def->value += delta;
+            labels = true;
+        }
+        if (labels) defs_changed(doc, c->defs[pass].data, c->defs[pass].len, pass);
+    }
+    for (size_t i = 0; i < c->backpatch.len; i++)
+        c->backpatch.data[i].addr += delta;
+    if (c->uses_addr[1]) {
+        c->backpatch_stale = true;
+        schedule(doc, c, 1);
+    }
+    c->addr = addr;
+    c->end_addr += delta;
+    return true;
+}
+
+// makes chunks after the i-th one start where it ends now
+static void chunk_retile(Document *doc, size_t i, bool end_changed) {
+    Chunk *c = doc->chunks.data[i];
+    int end = c->line + c->lines;
+    size_t j = i + 1;
+    while (j < doc->chunks.len && (c->ends_program || doc->chunks.data[j]->line < end))
+        chunk_drop(doc, doc->chunks.data[j++]);
+    memmove(&doc->chunks.data[i + 1], &doc->chunks.data[j], sizeof(Chunk *) * (doc->chunks.len - j));
+    doc->chunks.len -= j - (i + 1);
+    if (c->ends_program || end >= (int)doc->lines.len) return;
+    if (i + 1 == doc->chunks.len || doc->chunks.data[i + 1]->line > end)
+        chunk_insert(doc, i + 1, end);
+    else if (end_changed)
+        schedule(doc, doc->chunks.data[i + 1], 0);
+}
+
+// Scans for the end of a true conditional body in the same way a false one
+// is skipped, returns false if it's unterminated
+static bool lsp_body_end(Document *doc, Loc start, Loc *end) {
+    int depth = 1;
+    for (size_t line = start.line; line < doc->lines.len; line++) {
+        Line *l = &doc->lines.data[line];
+        int col = line == start.line ? start.col : 0;
+        if (col >= l->len) col = l->len - 1;
+        Lexer lex = {l->text + col, l->len - col, (Loc){line, col, doc->uri}};
+        if (skip_conditional_body(&lex, &depth)) {
+            *end = lex.loc;
+            return true;
+        }
+    }
+    return false;
+}
+
+// diagnostics which depend on the whole document, as at the end of assemble()
+static void lsp_check(Document *doc) {
+    for (size_t i = 0; i < doc->diags.len; i++)
+        free(doc->diags.data[i].message);
+    doc->diags.len = 0;
+    reset_scratch();
+    // only collects diagnostics, nothing here fails
+    error_jmp = &chunk_jmp;
+    Chunk *last = doc->chunks.len ? doc->chunks.data[doc->chunks.len - 1] : NULL;
+    if (last && last->end_cond_depth > 0) {
+        report_error((Loc){last->line + last->lines - 1, 0, doc->uri},
+                     "Unterminated conditional, expected `>`");
+    }
+    if (doc->overlaps > 0) {
+        // in the order assemble() puts words into ram
+        static RamEntry used[4096];
+        memset(used, 0, sizeof(used));
+        for (int pass = 0; pass < PASSES; pass++) {
+            for (size_t i = 0; i < doc->chunks.len; i++) {
+                Chunk *c = doc->chunks.data[i];
+                for (size_t j = 0; j < c->words[pass].len; j++) {
+                    Word w = c->words[pass].data[j];
+                    if (w.update) continue;
+                    Loc loc = w.loc;
+                    loc.line += c->line;
+                    for (int addr = w.addr; addr < w.addr + w.count; addr++) {
+                        if (used[addr].used) {
+                            report_error(loc, "Address %o was already used at %s:%d:%d (previous value %o, new %o)",
+                                         addr, PLOC(used[addr].loc), used[addr].v, w.v);
+                            break;
+                        }
+                        used[addr] = (RamEntry){loc, w.v, true};
+                    }
+                }
+            }
+        }
+    }
+    for (size_t i = 0; doc->cond_tests > 0 && i < doc->chunks.len; i++) {
+        Chunk *c = doc->chunks.data[i];
+        for (size_t j = 0; j < c->cond_tests.len; j++) {
+            CondTest test = c->cond_tests.data[j];
+            Symbol *s = symbol_get(doc, test.name.str, false);
+            Loc start = test.body_start, end = test.body_end, name = test.name.loc;
+            start.line += c->line;
+            end.line += c->line;
+            name.line += c->line;
+            if (!test.body_end_known && !lsp_body_end(doc, start, &end))
+                end = (Loc){UINT32_MAX, UINT8_MAX, doc->uri};
+            for (size_t k = 0; s && k < s->defs.len; k++) {
+                ChunkRef d = s->defs.data[k];
+                Loc at = def_entry(d)->loc;
+                at.line += d.chunk->line;
+                if (loc_before(start, at) && loc_before(at, end)) continue;
+                report_error(name,
+                             "`%.*s` is tested before its definition at %s:%d:%d "
+                             "(forward references are not allowed in conditions)",
+                             PS(test.name.str), PLOC(at));
+                break;
+            }
+        }
+    }
+    error_jmp = NULL;
+    for (size_t i = 0; i < diagnostics.len; i++)
+        da_append(doc->diags, diagnostics.data[i]);
+    diagnostics.len = 0;
+}
+
+// first pass of the i-th chunk, if its start state or names it looked up
+// have changed
+static void lsp_assemble(Document *doc, size_t i) {
+    Chunk *c = doc->chunks.data[i];
+    Chunk *prev = i > 0 ? doc->chunks.data[i - 1] : NULL;
+    int16_t addr = prev ? prev->end_addr : 0200;
+    Base base = prev ? prev->end_base : B_OCT;
+    int depth = prev ? prev->end_cond_depth : 0;
+    if (c->assembled && c->base == base && c->cond_depth == depth && !lookups_changed(c, 0)) {
+        int16_t end_addr = c->end_addr;
+        if (c->addr == addr) return;
+        // e.g. a line inserted before
+        if (chunk_move(doc, c, addr)) {
+            chunk_retile(doc, i, c->end_addr != end_addr);
+            return;
+        }
+    }
+    bool assembled = c->assembled;
+    int16_t end_addr = c->end_addr;
+    Base end_base = c->end_base;
+    int end_depth = c->end_cond_depth;
+    c->addr = addr;
+    c->base = base;
+    c->cond_depth = depth;
+    chunk_assemble(doc, c);
+    chunk_retile(doc, i, !assembled || c->end_addr != end_addr ||
+                         c->end_base != end_base || c->end_cond_depth != end_depth);
+}
+
+// assembles chunks scheduled by edits, and whatever they affect
+static void lsp_update(Document *doc) {
+    current_doc = doc;
+    // in order, the first pass only affects chunks after the one assembled,
+    // but a sweep is repeated if something before was queued anyway
+    for (int pass = 0; pass < PASSES; pass++) {
+        while (doc->queued[pass] > 0) {
+            size_t i = chunk_index(doc, doc->first[pass]);
+            doc->first[pass] = INT_MAX;
+            for (i = i == doc->chunks.len ? 0 : i; i < doc->chunks.len; i++) {
+                Chunk *c = doc->chunks.data[i];
+                if (!c->queued[pass]) continue;
+                c->queued[pass] = false;
+                doc->queued[pass]--;
+                if (pass == 0)
+                    lsp_assemble(doc, i);
+                else if (c->backpatch_stale || lookups_changed(c, 1))
+                    chunk_backpatch(doc, c);
+            }
+        }
+    }
+    for (size_t i = 0; i < doc->dead.len; i++)
+        chunk_free(doc->dead.data[i]);
+    doc->dead.len = 0;
+    lsp_check(doc);
+}
+// Replaces text between two positions. Chunks covering changed lines are
+// dropped, lsp_update() assembles the new lines.
+static void lsp_edit(Document *doc, int from, int from_col, int to, int to_col, char *text, size_t len) {
+    int count = doc->lines.len;
+    if (from > count - 1) from = count - 1;
+    if (to > count - 1) to = count - 1;
+    if (from < 0) from = 0;
+    if (to < from) to = from;
+    Line *first = &doc->lines.data[from], *last = &doc->lines.data[to];
+    if (from_col > first->len - 1) from_col = first->len - 1;
+    if (to_col > last->len - 1) to_col = last->len - 1;
+    if (from_col < 0) from_col = 0;
+    if (to_col < 0) to_col = 0;
+    size_t tail = last->len - 1 - to_col, n = from_col + len + tail;
+    char *s = malloc(n + 1);
+    assert(s != NULL);
+    memcpy(s, first->text, from_col);
+    memcpy(s + from_col, text, len);
+    memcpy(s + from_col + len, last->text + to_col, tail);
+    struct { Line *data; size_t len, cap; } added = {0};
+    for (char *p = s, *end = s + n;;) {
+        char *eol = memchr(p, '\n', end - p);
+        int length = (eol ? eol : end) - p;
+        Line line = {malloc(length + 2), length + 1};
+        assert(line.text != NULL);
+        memcpy(line.text, p, length);
+        line.text[length] = '\n';
+        line.text[length + 1] = '\0';
+        da_append(added, line);
+        if (eol == NULL) break;
+        p = eol + 1;
+    }
+    free(s);
+    int delta = (int)added.len - (to - from + 1);
+
+    size_t i = chunk_index(doc, from), j;
+    if (i == doc->chunks.len) i = 0;
+    else if (doc->chunks.data[i]->line + doc->chunks.data[i]->lines <= from) i++;
+    int start = i < doc->chunks.len ? doc->chunks.data[i]->line : -1;
+    for (j = i; j < doc->chunks.len && doc->chunks.data[j]->line <= to; j++)
+        chunk_drop(doc, doc->chunks.data[j]);
+    if (j == i) start = -1;
+    if (j < doc->chunks.len)
+        memmove(&doc->chunks.data[i], &doc->chunks.data[j], sizeof(Chunk *) * (doc->chunks.len - j));
+    doc->chunks.len -= j - i;
+    for (size_t k = i; k < doc->chunks.len; k++)
+        doc->chunks.data[k]->line += delta;
+    for (int pass = 0; pass < PASSES; pass++)
+        if (doc->first[pass] > to && doc->first[pass] != INT_MAX) doc->first[pass] += delta;
+
+    for (int k = from; k <= to; k++)
+        free(doc->lines.data[k].text);
+    size_t lines = doc->lines.len + delta;
+    if (lines > doc->lines.cap) {
+        doc->lines.cap = lines > doc->lines.cap * 2 ? lines : doc->lines.cap * 2;
+        doc->lines.data = realloc(doc->lines.data, sizeof(Line) * doc->lines.cap);
+        assert(doc->lines.data != NULL);
+    }
+    memmove(&doc->lines.data[from + added.len], &doc->lines.data[to + 1],
+            sizeof(Line) * (doc->lines.len - to - 1));
+    memcpy(&doc->lines.data[from], added.data, sizeof(Line) * added.len);
+    doc->lines.len = lines;
+    free(added.data);
+
+    if (start >= 0)
+        chunk_insert(doc, i, start);
+    else if (doc->chunks.len == 0)
+        chunk_insert(doc, 0, 0);
+}
+
+static void lsp_close(Document *doc) {
+    for (size_t i = 0; i < doc->chunks.len; i++)
+        chunk_free(doc->chunks.data[i]);
+    for (size_t i = 0; i < doc->symbols.size; i++) {
+        Symbol *s = doc->symbols.slots[i];
+        if (s == NULL) continue;
+        free(s->name.string);
+        free(s->defs.data);
+        free(s->deps.data);
+        free(s);
+    }
+    for (size_t i = 0; i < doc->lines.len; i++)
+        free(doc->lines.data[i].text);
+    for (size_t i = 0; i < doc->diags.len; i++)
+        free(doc->diags.data[i].message);
+    free(doc->chunks.data);
+    free(doc->symbols.slots);
+    free(doc->lines.data);
+    free(doc->dead.data);
+    free(doc->diags.data);
+    char *uri = doc->uri;
+    *doc = (Document){.uri = uri};
+}
+
+// ---- protocol ----
+
+struct {
+    Document *data;
+    size_t len, cap;
+} documents = { 0 };
+
+static char *lsp_read_message(int *length) {
+    int content_length = -1;
+    char header[256];
+    while (fgets(header, sizeof(header), stdin)) {
+        if (strcmp(header, "\r\n") == 0 || strcmp(header, "\n") == 0)
+            break;
+        if (strncmp(header, "Content-Length:", 15) == 0)
+            content_length = atoi(header + 15);
+    }
+    if (content_length < 0) return NULL;
+    char *body = malloc(content_length + 1);
+    assert(body != NULL);
+    if (fread(body, 1, content_length, stdin) != (size_t)content_length) {
+        free(body);
+        return NULL;
+    }
+    body[content_length] = '\0';
+    *length = content_length;
+    return body;
+}
+
+static void lsp_send(StringBuilder *sb) {
+    printf("Content-Length: %zu\r\n\r\n%.*s", sb->len, (int)sb->len, sb->data);
+    fflush(stdout);
+    sb->len = 0;
+}
+
+static Document *lsp_find_document(char *uri) {
+    if (uri == NULL) return NULL;
+    for (size_t i = 0; i < documents.len; i++) {
+        if (strcmp(documents.data[i].uri, uri) == 0)
+            return &documents.data[i];
+    }
+    return NULL;
+}
+
+static void lsp_append_range(StringBuilder *sb, int line, int col, int length) {
+    int start = col >= length ? col - length : 0;
+    sb_appendf(sb,
+               "{\"start\":{\"line\":%d,\"character\":%d},"
+               "\"end\":{\"line\":%d,\"character\":%d}}",
+               line, start, line, col);
+}
+
+static void lsp_append_location(StringBuilder *sb, Document *doc, int line, int col, int length) {
+    sb_appendf(sb, "{\"uri\":");
+    sb_append_json_string(sb, (String){doc->uri, strlen(doc->uri)});
+    sb_appendf(sb, ",\"range\":");
+    lsp_append_range(sb, line, col, length);
+    sb_appendf(sb, "}");
+}
+
+// length of the token ending at the position, diagnostics are reported there
+static int lsp_token_length(Document *doc, int line, int col) {
+    Chunk *c = chunk_at(doc, line);
+    for (size_t i = 0; c && i < c->tokens.len; i++) {
+        Token t = c->tokens.data[i];
+        if (t.loc.line == line - c->line && t.loc.col == col)
+            return t.str.length;
+    }
+    return 0;
+}
+
+static void lsp_append_diagnostic(StringBuilder *sb, bool *first, Document *doc, Diagnostic d, int line) {
+    if (!*first) sb_appendf(sb, ",");
+    *first = false;
+    sb_appendf(sb, "{\"range\":");
+    lsp_append_range(sb, line, d.loc.col, lsp_token_length(doc, line, d.loc.col));
+    sb_appendf(sb, ",\"severity\":1,\"source\":\"gal\",\"message\":");
+    sb_append_json_string(sb, (String){d.message, strlen(d.message)});
+    sb_appendf(sb, "}");
+}
+
+static void lsp_publish_diagnostics(StringBuilder *sb, Document *doc) {
+    sb_appendf(sb, "{\"jsonrpc\":\"2.0\",\"method\":\"textDocument/publishDiagnostics\","
+                   "\"params\":{\"uri\":");
+    sb_append_json_string(sb, (String){doc->uri, strlen(doc->uri)});
+    sb_appendf(sb, ",\"diagnostics\":[");
+    bool first = true;
+    for (size_t i = 0; doc->chunk_diags > 0 && i < doc->chunks.len; i++) {
+        Chunk *c = doc->chunks.data[i];
+        for (int pass = 0; pass < PASSES; pass++) {
+            for (size_t j = 0; j < c->diags[pass].len; j++) {
+                Diagnostic d = c->diags[pass].data[j];
+                lsp_append_diagnostic(sb, &first, doc, d, c->line + d.loc.line);
+            }
+        }
+    }
+    for (size_t i = 0; i < doc->diags.len; i++)
+        lsp_append_diagnostic(sb, &first, doc, doc->diags.data[i], doc->diags.data[i].loc.line);
+    sb_appendf(sb, "]}}");
+    lsp_send(sb);
+}
+
+static bool loc_contains(Loc loc, int length, int line, int col) {
+    return loc.line == line && loc.col - length <= col && col <= loc.col;
+}
+
+// finds a name under the cursor in tokens of its line
+static bool lsp_name_at(Document *doc, int line, int col, String *out) {
+    Chunk *c = chunk_at(doc, line);
+    for (size_t i = 0; c && i < c->tokens.len; i++) {
+        Token t = c->tokens.data[i];
+        if (t.kind == LEX_NAME && loc_contains(t.loc, t.str.length, line - c->line, col)) {
+            *out = t.str;
+            return true;
+        }
+    }
+    return false;
+}
+
+static void lsp_append_definitions(StringBuilder *sb, Document *doc, Symbol *s, bool *first) {
+    for (size_t i = 0; s && i < s->defs.len; i++) {
+        ChunkRef d = s->defs.data[i];
+        NameEntry *def = def_entry(d);
+        if (!*first) sb_appendf(sb, ",");
+        *first = false;
+        lsp_append_location(sb, doc, d.chunk->line + def->loc.line, def->loc.col, def->name.length);
+    }
+}
+
+static void lsp_respond_definition(StringBuilder *sb, Document *doc, String name) {
+    bool first = true;
+    sb_appendf(sb, "[");
+    lsp_append_definitions(sb, doc, symbol_get(doc, name, false), &first);
+    sb_appendf(sb, "]");
+}
+
+static void lsp_respond_references(StringBuilder *sb, Document *doc, String name, bool declarations) {
+    Symbol *s = symbol_get(doc, name, false);
+    bool first = true;
+    sb_appendf(sb, "[");
+    if (declarations)
+        lsp_append_definitions(sb, doc, s, &first);
+    // uses are recorded in the first pass, which also looks the name up
+    for (size_t i = 0; s && i < s->deps.len; i++) {
+        if (s->deps.data[i].pass != 0) continue;
+        Chunk *c = s->deps.data[i].chunk;
+        for (size_t j = 0; j < c->refs.len; j++) {
+            NameRef ref = c->refs.data[j];
+            if (!string_eq(ref.name, name)) continue;
+            if (!first) sb_appendf(sb, ",");
+            first = false;
+            lsp_append_location(sb, doc, c->line + ref.loc.line, ref.loc.col, name.length);
+        }
+    }
+    sb_appendf(sb, "]");
+}
+
+static void lsp_respond_hover(StringBuilder *sb, Document *doc, int line, int col) {
+    StringBuilder text = {0};
+    String name;
+    Symbol *s;
+    int16_t v;
+    Chunk *c = chunk_at(doc, line);
+    if (lsp_name_at(doc, line, col, &name) && (s = symbol_get(doc, name, false)) != NULL &&
+        symbol_lookup(s, INT_MAX, 1, &v)) {
+        sb_appendf(&text, "%.*s = %04o", PS(name), v);
+    } else if (c != NULL) {
+        for (int pass = 0; pass < PASSES; pass++) {
+            for (size_t i = 0; i < c->words[pass].len; i++) {
+                Word w = c->words[pass].data[i];
+                if (w.update || w.loc.line != line - c->line) continue;
+                // FILL block gets its value while backpatching
+                for (size_t j = 0; pass == 0 && j < c->words[1].len; j++) {
+                    Word u = c->words[1].data[j];
+                    if (u.update && u.addr == w.addr) w.v = u.v;
+                }
+                for (int addr = w.addr; addr < w.addr + w.count; addr++)
+                    sb_appendf(&text, "%s%04o: %04o", text.len ? "\n" : "", addr, w.v);
+            }
+        }
+    }
+    if (text.len == 0) {
+        sb_appendf(sb, "null");
+    } else {
+        sb_appendf(sb, "{\"contents\":{\"kind\":\"plaintext\",\"value\":");
+        sb_append_json_string(sb, (String){text.data, text.len});
+        sb_appendf(sb, "}}");
+    }
+    free(text.data);
+}
+
+// applies `contentChanges` of didChange, a change without range replaces
+// the whole text
+static void lsp_apply_changes(Document *doc, String changes) {
+    String change;
+    while (json_next_element(&changes, &change)) {
+        size_t len;
+        char *text = json_get_string(change, "text", &len);
+        if (text == NULL) continue;
+        String range, start, end;
+        if (json_get(change, "range", &range) && json_get(range, "start", &start) &&
+            json_get(range, "end", &end)) {
+            lsp_edit(doc, json_get_int(start, "line"), json_get_int(start, "character"),
+                     json_get_int(end, "line"), json_get_int(end, "character"), text, len);
+        } else {
+            lsp_edit(doc, 0, 0, INT_MAX, INT_MAX, text, len);
+        }
+        free(text);
+    }
+}
+
+int lsp_main(void) {
+    StringBuilder sb = {0};
+    bool shutdown = false;
+    char *body;
+    int length;
+    while ((body = lsp_read_message(&length)) != NULL) {
+        String msg = {body, length};
+        char *method = json_get_string(msg, "method", NULL);
+        String id;
+        bool has_id = json_get(msg, "id", &id);
+        char *uri = json_get_string(msg, "uri", NULL);
+        Document *doc = lsp_find_document(uri);
+        if (method == NULL) {
+            // response to a request we never send
+        } else if (strcmp(method, "initialize") == 0) {
+            sb_appendf(&sb, "{\"jsonrpc\":\"2.0\",\"id\":%.*s,\"result\":{\"capabilities\":{"
+                            "\"textDocumentSync\":2,\"definitionProvider\":true,"
+                            "\"referencesProvider\":true,\"hoverProvider\":true},"
+                            "\"serverInfo\":{\"name\":\"gal\"}}}", PS(id));
+            lsp_send(&sb);
+        } else if (strcmp(method, "shutdown") == 0) {
+            shutdown = true;
+            sb_appendf(&sb, "{\"jsonrpc\":\"2.0\",\"id\":%.*s,\"result\":null}", PS(id));
+            lsp_send(&sb);
+        } else if (strcmp(method, "exit") == 0) {
+            free(method);
+            free(uri);
+            free(body);
+            break;
+        } else if (strcmp(method, "textDocument/didOpen") == 0) {
+            size_t len;
+            char *text = json_get_string(msg, "text", &len);
+            if (text != NULL && uri != NULL) {
+                if (doc == NULL) {
+                    da_append(documents, ((Document){.uri = uri}));
+                    doc = &documents.data[documents.len - 1];
+                    uri = NULL;
+                } else {
+                    lsp_close(doc);
+                }
+                char *nl = malloc(2);
+                assert(nl != NULL);
+                memcpy(nl, "\n", 2);
+                da_append(doc->lines, ((Line){nl, 1}));
+                lsp_edit(doc, 0, 0, 0, 0, text, len);
+                lsp_update(doc);
+                lsp_publish_diagnostics(&sb, doc);
+            }
+            free(text);
+        } else if (strcmp(method, "textDocument/didChange") == 0) {
+            String changes;
+            if (doc != NULL && json_get(msg, "contentChanges", &changes)) {
+                lsp_apply_changes(doc, changes);
+                lsp_update(doc);
+                lsp_publish_diagnostics(&sb, doc);
+            }
+        } else if (strcmp(method, "textDocument/didClose") == 0) {
+            if (doc != NULL) {
+                lsp_close(doc);
+                lsp_publish_diagnostics(&sb, doc);
+                free(doc->uri);
+                *doc = documents.data[--documents.len];
+            }
+        } else if (strcmp(method, "textDocument/definition") == 0 ||
+                   strcmp(method, "textDocument/references") == 0 ||
+                   strcmp(method, "textDocument/hover") == 0) {
+            int line = json_get_int(msg, "line"), col = json_get_int(msg, "character");
+            sb_appendf(&sb, "{\"jsonrpc\":\"2.0\",\"id\":%.*s,\"result\":", PS(id));
+            String name;
+            if (doc == NULL) {
+                sb_appendf(&sb, "null");
+            } else if (strcmp(method, "textDocument/hover") == 0) {
+                lsp_respond_hover(&sb, doc, line, col);
+            } else if (!lsp_name_at(doc, line, col, &name)) {
+                sb_appendf(&sb, "null");
+            } else if (strcmp(method, "textDocument/definition") == 0) {
+                lsp_respond_definition(&sb, doc, name);
+            } else {
+                String decl;
+                bool declarations = json_get(msg, "includeDeclaration", &decl) &&
+                                    string_eq(decl, S("true"));
+                lsp_respond_references(&sb, doc, name, declarations);
+            }
+            sb_appendf(&sb, "}");
+            lsp_send(&sb);
+        } else if (has_id) {
+            sb_appendf(&sb, "{\"jsonrpc\":\"2.0\",\"id\":%.*s,\"error\":{\"code\":-32601,"
+                            "\"message\":\"Method not found\"}}", PS(id));
+            lsp_send(&sb);
+        }
+        free(method);
+        free(uri);
+        free(body);
+    }
+    return shutdown ? 0 : 1;
+}
+
 char *next_arg(int* argc, char ***argv, char* error) {
     if (*argc == 0) {
         if (error != NULL) {
@@ -787,11 +3090,33 @@ char *next_arg(int* argc, char ***argv, char* error) {
 int main(int argc, char *argv[]) {
     char *program_name = next_arg(&argc, &argv, NULL),
          *input_file   = NULL,
-         *output_file  = NULL;
+         *output_file  = NULL,
+         *map_file     = NULL,
+         *map_text_file = NULL,
+         *lst_file     = NULL,
+         *xref_file    = NULL;
+    bool lsp = false, compile = false;
+    pst_init_builtin();
     while (argc) {
         char *arg = next_arg(&argc, &argv, NULL);
-        if (strcmp(arg, "-o") == 0) {
+        if (strcmp(arg, "--lsp") == 0) {
+            lsp = true;
+        } else if (strcmp(arg, "--pst") == 0) {
+            // several files are layered in the order given
+            if (!load_pst(next_arg(&argc, &argv, "Argument `--pst` expects PST filename next")))
+                return 1;
+        } else if (strcmp(arg, "--compile-pst") == 0) {
+            compile = true;
+        } else if (strcmp(arg, "-o") == 0) {
             output_file = next_arg(&argc, &argv, "Argument `-o` expects output filename next");
+        } else if (strcmp(arg, "--map") == 0) {
+            map_file = next_arg(&argc, &argv, "Argument `--map` expects map filename next");
+        } else if (strcmp(arg, "--map-text") == 0) {
+            map_text_file = next_arg(&argc, &argv, "Argument `--map-text` expects map filename next");
+        } else if (strcmp(arg, "--lst") == 0) {
+            lst_file = next_arg(&argc, &argv, "Argument `--lst` expects listing filename next");
+        } else if (strcmp(arg, "--xref") == 0) {
+            xref_file = next_arg(&argc, &argv, "Argument `--xref` expects cross-reference filename next");
         } else if (strcmp(arg, "-static") == 0) {
             // just compatibility with GAS
         } else {
@@ -803,6 +3128,9 @@ int main(int argc, char *argv[]) {
             }
         }
     }
+    if (lsp) {
+        return lsp_main();
+    }
     if (!input_file) {
         fprintf(stderr, "No input file was provided.\n");
         return 1;
@@ -811,6 +3139,9 @@ int main(int argc, char *argv[]) {
         fprintf(stderr, "No output file was provided.\n");
         return 1;
     }
+    if (compile) {
+        return compile_pst(input_file, output_file) ? 0 : 1;
+    }
     FILE *f = fopen(input_file, "r");
     if (f == NULL) {
         fprintf(stderr, "Couldn't open %s\n", input_file);
@@ -842,4 +3173,43 @@ int main(int argc, char *argv[]) {
     }
     export_dec_obj(f);
     fclose(f);
+
+    if (map_file) {
+        f = fopen(map_file, "wb");
+        if (f == NULL) {
+            fprintf(stderr, "Couldn't open `%s`\n", map_file);
+            return 1;
+        }
+        export_map(f, input_file);
+        fclose(f);
+    }
+    if (map_text_file) {
+        f = fopen(map_text_file, "w");
+        if (f == NULL) {
+            fprintf(stderr, "Couldn't open `%s`\n", map_text_file);
+            return 1;
+        }
+        export_map_text(f, input_file);
+        fclose(f);
+    }
+    if (lst_file) {
+        f = fopen(lst_file, "w");
+        if (f == NULL) {
+            fprintf(stderr, "Couldn't open `%s`\n", lst_file);
+            return 1;
+        }
+        setvbuf(f, NULL, _IOFBF, 1 << 16);
+        export_listing(f, (String){str.string, size});
+        fclose(f);
+    }
+    if (xref_file) {
+        f = fopen(xref_file, "w");
+        if (f == NULL) {
+            fprintf(stderr, "Couldn't open `%s`\n", xref_file);
+            return 1;
+        }
+        setvbuf(f, NULL, _IOFBF, 1 << 16);
+        export_xref(f);
+        fclose(f);
+    }
 }